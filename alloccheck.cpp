@@ -0,0 +1,111 @@
+#include <iostream>
+#include <atomic>
+#include <errno.h>
+#include <stddef.h>
+
+#include "alloccheck.h"
+
+using namespace std;
+
+// glibc's own entry points, the interposed ones below forward to them
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+}
+
+static const char *eventName[ALLOC_EVENTS] = { "none", "callback", "keypress",
+    "command", "alert", "source", "call", "timer", "cec send", "ir send" };
+
+// Plain storage, nothing here may allocate itself
+static atomic<bool> armed(false);
+static atomic<uint64_t> allocs[ALLOC_EVENTS];
+static atomic<uint64_t> frees[ALLOC_EVENTS];
+static thread_local AllocEvent current = ALLOC_NONE;
+
+static inline void countAlloc() {
+  if (current != ALLOC_NONE && armed.load(memory_order_relaxed)) {
+    allocs[current].fetch_add(1, memory_order_relaxed);
+  }
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+  countAlloc();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  countAlloc();
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  countAlloc();
+  return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  countAlloc();
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  countAlloc();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+  // A power of two multiple of sizeof(void *)
+  if (!alignment || alignment % sizeof(void *)
+      || (alignment & (alignment - 1))) {
+    return EINVAL;
+  }
+  countAlloc();
+  void *p = __libc_memalign(alignment, size);
+  if (!p) {
+    return ENOMEM;
+  }
+  *out = p;
+  return 0;
+}
+
+void free(void *p) {
+  if (p && current != ALLOC_NONE && armed.load(memory_order_relaxed)) {
+    frees[current].fetch_add(1, memory_order_relaxed);
+  }
+  __libc_free(p);
+}
+
+}
+
+AllocScope::AllocScope(AllocEvent event) : saved(current) {
+  current = event;
+}
+
+AllocScope::~AllocScope() {
+  current = saved;
+}
+
+void allocCheckArm() {
+  for (unsigned i = 0; i < ALLOC_EVENTS; i++) {
+    allocs[i] = 0;
+    frees[i] = 0;
+  }
+  armed = true;
+}
+
+uint64_t allocCheckReport() {
+  uint64_t total = 0;
+
+  armed = false;
+  for (unsigned i = ALLOC_NONE + 1; i < ALLOC_EVENTS; i++) {
+    cout << "alloccheck: " << eventName[i] << " " << allocs[i]
+        << " allocations, " << frees[i] << " frees" << endl;
+    total += allocs[i] + frees[i];
+  }
+  return total;
+}
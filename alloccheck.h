@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// Allocation check for the event path, built with make BUILD_MODE=alloccheck
+// (ALLOC_CHECK defined, alloccheck.o linked).  malloc() and friends are
+// interposed and count the calls made inside an AllocScope, per event type,
+// once allocCheckArm() was called.  The soak test arms the check after its
+// warm-up and fails on any allocation.  In other builds the scopes compile
+// to nothing.
+
+enum AllocEvent {
+  ALLOC_NONE,
+  ALLOC_CALLBACK,     // libcec callback threads
+  ALLOC_KEYPRESS,     // dispatch thread handlers
+  ALLOC_COMMAND,
+  ALLOC_ALERT,
+  ALLOC_SOURCE,
+  ALLOC_CALL,
+  ALLOC_TIMER,
+  ALLOC_CEC_SEND,     // transmit queue worker
+  ALLOC_IR_SEND,      // lircd transmitter threads
+  ALLOC_EVENTS
+};
+
+#ifdef ALLOC_CHECK
+
+void allocCheckArm();
+// Prints the counts per event type, returns the total number of calls
+uint64_t allocCheckReport();
+
+struct AllocScope {
+  AllocScope(AllocEvent event);
+  ~AllocScope();
+  AllocEvent saved;
+};
+
+#else
+
+static inline void allocCheckArm() {}
+static inline uint64_t allocCheckReport() { return 0; }
+
+struct AllocScope {
+  AllocScope(AllocEvent) {}
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include <iostream>
+
+#include "cec-lirc.h"
+#include "audiostatus.h"
+#include "bridgestate.h"
+#include "profiles.h"
+
+using namespace std;
+using namespace CEC;
+
+static unsigned volume = 0;
+static bool muted = false;
+static unsigned step = 1;
+static unsigned repeatMs = 0;
+
+static void changed() {
+  stateAudio(volume, muted);
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "audioStatus: volume " << dec << volume
+          << (muted ? " muted" : "") << '\n';
+}
+
+static void adjust(bool up, unsigned steps) {
+  unsigned delta = steps * step;
+  if (up) {
+    volume = volume + delta > 100 ? 100 : volume + delta;
+  } else {
+    volume = delta > volume ? 0 : volume - delta;
+  }
+  muted = false;
+  changed();
+}
+
+void audioStatusInit(int device) {
+  const IrProfile &profile = profileGet(device);
+  BridgeState s;
+  volume = profile.volume;
+  step = profile.volumeStep;
+  repeatMs = profile.volumeRepeatMs;
+  muted = false;
+  // Carry on from a state restored by stateFileLoad()
+  if (stateSnapshot(s) && s.volume != BRIDGE_UNKNOWN) {
+    volume = s.volume;
+    muted = s.mute == 1;
+  }
+  changed();
+}
+
+void audioVolumePressed(bool up) {
+  adjust(up, 1);
+}
+
+void audioVolumeReleased(bool up, unsigned durationMs) {
+  // The first step was accounted for on the press
+  if (repeatMs && durationMs >= repeatMs) {
+    adjust(up, durationMs / repeatMs);
+  }
+}
+
+void audioMuteToggled() {
+  muted = !muted;
+  changed();
+}
+
+uint8_t audioStatus() {
+  return (muted ? 0x80 : 0) | (volume & 0x7f);
+}
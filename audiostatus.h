@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// Estimated amp volume and mute state.  IR is one way, so the model is
+// driven by the codes the bridge sends: one volume step per code plus one
+// per volume-repeat ms a volume key is held, mute toggles and a volume
+// change unmutes like most amps do.  Used to answer <Give Audio Status>
+// without a round trip to the amp.
+//
+// Only to be used from the dispatch thread.
+
+// Start from the restored state or else the profile volume estimate
+// (profile index)
+void audioStatusInit(int device);
+
+void audioVolumePressed(bool up);
+// durationMs is the hold time libcec reports with the release
+void audioVolumeReleased(bool up, unsigned durationMs);
+void audioMuteToggled();
+
+// [Audio Status] operand: mute in bit 7, volume 0-100 in bits 0-6
+uint8_t audioStatus();
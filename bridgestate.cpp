@@ -0,0 +1,252 @@
+#include <iostream>
+#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libcec/cec.h"
+#include "bridgestate.h"
+
+using namespace std;
+using namespace CEC;
+
+static BridgeState *shared = nullptr;
+static const char *shmName = nullptr;
+// Used instead of the segment when it is disabled
+static BridgeState local;
+// Serialises the bridge threads, readers never take it.  The dispatch
+// thread may run under SCHED_FIFO while a control or lircd thread holds
+// it, so it inherits priority.
+static pthread_mutex_t writer;
+static pthread_once_t writerOnce = PTHREAD_ONCE_INIT;
+
+static uint64_t realtimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Run fn inside the seqlock write section
+template<typename F> static void update(F fn) {
+  if (!shared) {
+    return;
+  }
+  pthread_mutex_lock(&writer);
+  uint32_t seq = shared->seq;
+  __atomic_store_n(&shared->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  fn(*shared);
+  shared->updatedNs = realtimeNs();
+
+  __atomic_store_n(&shared->seq, seq + 2, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&writer);
+}
+
+static void writerInit() {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&writer, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void reset(BridgeState *state) {
+  // Readers of a previous run may still have it mapped, go through the
+  // seqlock rather than wiping it under them
+  uint32_t seq = state->seq | 1;
+  __atomic_store_n(&state->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memset((char *) state + offsetof(BridgeState, pid), 0,
+      sizeof(BridgeState) - offsetof(BridgeState, pid));
+  state->magic = BRIDGE_STATE_MAGIC;
+  state->version = BRIDGE_STATE_VERSION;
+  state->pid = getpid();
+  state->ampOn = BRIDGE_UNKNOWN;
+  state->systemAudio = BRIDGE_UNKNOWN;
+  state->activeSource = BRIDGE_UNKNOWN;
+  state->lastKey = BRIDGE_UNKNOWN;
+  state->activePath = 0xffff;
+  state->volume = BRIDGE_UNKNOWN;
+  state->mute = BRIDGE_UNKNOWN;
+  memset(state->power, CEC_POWER_STATUS_UNKNOWN, sizeof(state->power));
+  state->updatedNs = realtimeNs();
+  __atomic_store_n(&state->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Maps the named segment, null on failure
+static BridgeState *mapShared(const char *name) {
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    cerr << "stateOpen: shm_open " << name << ": " << strerror(errno) << endl;
+    return nullptr;
+  }
+  if (ftruncate(fd, sizeof(BridgeState)) < 0) {
+    cerr << "stateOpen: ftruncate " << strerror(errno) << endl;
+    close(fd);
+    return nullptr;
+  }
+  void *map = mmap(nullptr, sizeof(BridgeState), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    cerr << "stateOpen: mmap " << strerror(errno) << endl;
+    return nullptr;
+  }
+  return (BridgeState *) map;
+}
+
+bool stateOpen(const char *name) {
+  BridgeState *map = nullptr;
+
+  pthread_once(&writerOnce, writerInit);
+  if (name[0]) {
+    map = mapShared(name);
+    if (!map) {
+      // The bridge relies on the state, only the readers go without it
+      cerr << "stateOpen: keeping the state in process memory only" << endl;
+    }
+  }
+  if (!map) {
+    reset(&local);
+    shared = &local;
+    return !name[0];
+  }
+
+  reset(map);
+  shmName = name;
+  shared = map;
+  return true;
+}
+
+void stateClose() {
+  if (!shared) {
+    return;
+  }
+  if (shared != &local) {
+    munmap(shared, sizeof(BridgeState));
+    // Consumers must not mistake a stale segment for a running bridge
+    shm_unlink(shmName);
+  }
+  shared = nullptr;
+}
+
+void stateCommand(uint8_t initiator, uint8_t opcode, const uint8_t *params,
+    uint8_t len) {
+  update([&](BridgeState &s) {
+    s.commands++;
+    switch (opcode) {
+    case CEC_OPCODE_REPORT_POWER_STATUS:
+      if (len >= 1 && initiator < 16) {
+        s.power[initiator] = params[0];
+      }
+      break;
+    case CEC_OPCODE_ACTIVE_SOURCE:
+      if (len >= 2) {
+        s.activeSource = initiator;
+        s.activePath = (params[0] << 8) | params[1];
+      }
+      break;
+    case CEC_OPCODE_ROUTING_CHANGE:
+      // original address, new address
+      if (len >= 4) {
+        s.activePath = (params[2] << 8) | params[3];
+      }
+      break;
+    case CEC_OPCODE_SET_STREAM_PATH:
+      if (len >= 2) {
+        s.activePath = (params[0] << 8) | params[1];
+      }
+      break;
+    case CEC_OPCODE_SET_SYSTEM_AUDIO_MODE:
+    case CEC_OPCODE_SYSTEM_AUDIO_MODE_STATUS:
+      if (len >= 1) {
+        s.systemAudio = params[0] ? 1 : 0;
+      }
+      break;
+    default:
+      break;
+    }
+  });
+}
+
+void stateKeyPress(uint8_t keycode) {
+  update([&](BridgeState &s) {
+    s.keyPresses++;
+    s.lastKey = keycode;
+    s.lastKeyNs = realtimeNs();
+  });
+}
+
+void stateAmp(bool on) {
+  update([&](BridgeState &s) {
+    s.ampOn = on;
+    s.systemAudio = on;
+    if (on) {
+      s.audioOn++;
+    } else {
+      s.audioOff++;
+    }
+  });
+}
+
+void statePower(uint8_t logicalAddress, uint8_t power) {
+  if (logicalAddress >= 16) {
+    return;
+  }
+  update([&](BridgeState &s) {
+    s.power[logicalAddress] = power;
+  });
+}
+
+void stateActiveSource(uint8_t logicalAddress, bool activated) {
+  update([&](BridgeState &s) {
+    if (activated) {
+      s.activeSource = logicalAddress;
+    } else if (s.activeSource == logicalAddress) {
+      s.activeSource = BRIDGE_UNKNOWN;
+    }
+  });
+}
+
+void stateAudio(uint8_t volume, bool mute) {
+  update([&](BridgeState &s) {
+    s.volume = volume;
+    s.mute = mute;
+  });
+}
+
+void stateRestore(const BridgeState &saved) {
+  update([&](BridgeState &s) {
+    s.ampOn = saved.ampOn;
+    s.systemAudio = saved.systemAudio;
+    s.activeSource = saved.activeSource;
+    s.activePath = saved.activePath;
+    s.volume = saved.volume;
+    s.mute = saved.mute;
+    memcpy(s.power, saved.power, sizeof(s.power));
+  });
+}
+
+bool stateSnapshot(BridgeState &out) {
+  return shared && bridgeStateRead(shared, out);
+}
+
+void stateCount(StateCounter counter, bool ok) {
+  update([&](BridgeState &s) {
+    switch (counter) {
+    case STATE_IR_SEND:
+      s.irSends++;
+      s.irFailures += !ok;
+      break;
+    case STATE_KODI_SEND:
+      s.kodiSends++;
+      s.kodiFailures += !ok;
+      break;
+    }
+  });
+}
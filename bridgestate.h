@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Live bridge state published in POSIX shared memory for local consumers
+// (Kodi add-ons, home automation).  The segment is guarded by a seqlock:
+// the bridge makes seq odd while it writes and even again when done, a
+// reader copies the struct and retries if seq was odd or changed meanwhile.
+// Readers need no syscalls after mapping the segment and never block the
+// bridge.  This header is all a C/C++ reader needs, see bridgeStateRead().
+//
+// Other languages can map /dev/shm/cec-lirc-state and apply the same
+// protocol to the layout below (native endianness, no padding).
+
+#define BRIDGE_STATE_SHM     "/cec-lirc-state"
+#define BRIDGE_STATE_MAGIC   0x43454353   // "SCEC"
+#define BRIDGE_STATE_VERSION 1
+#define BRIDGE_UNKNOWN       0xff
+
+struct BridgeState {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;              // odd while the bridge is writing
+  uint32_t pid;
+
+  uint8_t  ampOn;            // 1 on, 0 off, BRIDGE_UNKNOWN
+  uint8_t  systemAudio;      // system audio mode 1 on, 0 off, BRIDGE_UNKNOWN
+  uint8_t  activeSource;     // logical address or BRIDGE_UNKNOWN
+  uint8_t  lastKey;          // cec_user_control_code
+  uint16_t activePath;       // physical address of the active route
+  uint8_t  volume;           // estimated amp volume 0-100
+  uint8_t  mute;             // estimated amp mute 1 on, 0 off
+  uint8_t  power[16];        // cec_power_status per logical address
+
+  uint64_t updatedNs;        // CLOCK_REALTIME of the last change
+  uint64_t lastKeyNs;        // CLOCK_REALTIME of the last key press
+
+  uint64_t commands;         // CEC commands received
+  uint64_t keyPresses;
+  uint64_t irSends;
+  uint64_t irFailures;
+  uint64_t kodiSends;
+  uint64_t kodiFailures;
+  uint64_t audioOn;          // turnAudioOn() calls
+  uint64_t audioOff;         // turnAudioOff() calls
+};
+
+// Consistent snapshot of a mapped segment, false if the segment is not a
+// bridge state segment or the bridge kept writing for too long
+static inline bool bridgeStateRead(const BridgeState *shared, BridgeState &out) {
+  for (int tries = 0; tries < 1000; tries++) {
+    uint32_t before = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      continue;
+    }
+    memcpy(&out, (const void *) shared, sizeof(out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == before) {
+      return out.magic == BRIDGE_STATE_MAGIC
+          && out.version == BRIDGE_STATE_VERSION;
+    }
+  }
+  return false;
+}
+
+static_assert(sizeof(BridgeState) == 120, "BridgeState layout");
+
+// Bridge side, all functions are no-ops until stateOpen() was called.  An
+// empty name keeps the state in process memory only, as does a segment
+// that cannot be created, for which stateOpen() returns false.
+bool stateOpen(const char *name);
+void stateClose();
+
+enum StateCounter {
+  STATE_IR_SEND,
+  STATE_KODI_SEND
+};
+
+void stateCommand(uint8_t initiator, uint8_t opcode, const uint8_t *params,
+    uint8_t len);
+void stateKeyPress(uint8_t keycode);
+// Amp switched by turnAudioOn()/turnAudioOff()
+void stateAmp(bool on);
+void statePower(uint8_t logicalAddress, uint8_t power);
+void stateActiveSource(uint8_t logicalAddress, bool activated);
+void stateAudio(uint8_t volume, bool mute);
+void stateCount(StateCounter counter, bool ok = true);
+// Take over amp, audio, routing and power state saved by a previous run
+void stateRestore(const BridgeState &saved);
+// Snapshot for in process readers, false when the segment is not open
+bool stateSnapshot(BridgeState &out);
@@ -0,0 +1,191 @@
+// Decoder for the cec-lirc flight recorder file
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <ctime>
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flightrec.h"
+
+using namespace std;
+
+const char *argp_program_version = "cec-flightrec 1.0";
+const char *argp_program_bug_address = "https://github.com/ballle98/cec-lirc";
+
+static const char *fileName = FLIGHTREC_PATH;
+static int typeFilter = 0;
+static int opcodeFilter = -1;
+static int addressFilter = -1;
+static size_t lastN = 0;
+
+static const char *typeNames[] = { "", "start", "command", "key", "alert",
+    "source", "action" };
+static const char *actionNames[] = { "", "ir", "kodi", "cec", "audio-on",
+    "audio-off", "warm-up" };
+static const unsigned ACTIONS = sizeof(actionNames) / sizeof(actionNames[0]);
+
+static struct argp_option options[] = {
+    { "type", 't', "TYPE", 0,
+    "Only show records of TYPE (start, command, key, alert, source, action)" },
+    { "opcode", 'o', "OPCODE", 0, "Only show CEC commands with OPCODE" },
+    { "address", 'a', "LA", 0,
+    "Only show CEC commands from or to logical address LA" },
+    { "last", 'n', "N", 0, "Only show the last N matching records" },
+    { 0 } };
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+  switch (key) {
+  case 't':
+    for (size_t i = 1; i < sizeof(typeNames) / sizeof(typeNames[0]); i++) {
+      if (strcmp(arg, typeNames[i]) == 0) {
+        typeFilter = i;
+      }
+    }
+    if (!typeFilter) {
+      argp_error(state, "unknown record type %s", arg);
+    }
+    break;
+  case 'o':
+    opcodeFilter = strtol(arg, nullptr, 16);
+    break;
+  case 'a':
+    addressFilter = strtol(arg, nullptr, 16);
+    break;
+  case 'n':
+    lastN = strtoul(arg, nullptr, 10);
+    break;
+  case ARGP_KEY_ARG:
+    fileName = arg;
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+static struct argp argp = { options, parse_opt, "[FILE]",
+    "Print the cec-lirc flight recorder history, oldest record first" };
+
+static bool matches(const FlightRecord &rec) {
+  if (typeFilter && rec.type != typeFilter) {
+    return false;
+  }
+  if (opcodeFilter >= 0 || addressFilter >= 0) {
+    if (rec.type != FR_COMMAND) {
+      return false;
+    }
+    if (opcodeFilter >= 0 && rec.c != opcodeFilter) {
+      return false;
+    }
+    if (addressFilter >= 0 && rec.a != addressFilter && rec.b != addressFilter) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void print(const FlightRecord &rec) {
+  time_t secs = rec.timeNs / 1000000000ull;
+  unsigned millis = (rec.timeNs / 1000000ull) % 1000;
+
+  cout << "[" << put_time(localtime(&secs), "%D %T") << "." << dec
+      << setw(3) << setfill('0') << millis << "] " << setfill(' ') << setw(8)
+      << rec.seq << " " << setw(7) << left
+      << (rec.type < 7 ? typeNames[rec.type] : "?") << right << " ";
+
+  switch (rec.type) {
+  case FR_START:
+    cout << "pid " << rec.value;
+    break;
+  case FR_COMMAND:
+    cout << hex << setfill('0') << setw(1) << unsigned(rec.a) << setw(1)
+        << unsigned(rec.b) << ":" << setw(2) << unsigned(rec.c);
+    for (unsigned i = 0; i < rec.len; i++) {
+      cout << ":" << setw(2) << unsigned(rec.data[i]);
+    }
+    cout << dec << setfill(' ');
+    break;
+  case FR_KEYPRESS:
+    cout << "key 0x" << hex << unsigned(rec.a) << dec << " duration "
+        << rec.value;
+    break;
+  case FR_ALERT:
+    cout << "alert " << rec.value;
+    break;
+  case FR_SOURCE:
+    cout << "LA " << unsigned(rec.a) << " activated " << unsigned(rec.b);
+    break;
+  case FR_ACTION:
+    cout << (rec.a < ACTIONS ? actionNames[rec.a] : "?") << " "
+        << string((const char *) rec.data, rec.len)
+        << (rec.ok ? "" : " FAILED");
+    break;
+  }
+  cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    cerr << fileName << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(FlightHeader)) {
+    cerr << fileName << ": not a flight recorder file" << endl;
+    return 1;
+  }
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    cerr << fileName << ": mmap " << strerror(errno) << endl;
+    return 1;
+  }
+
+  const FlightHeader *hdr = (const FlightHeader *) map;
+  if (memcmp(hdr->magic, FLIGHTREC_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->recordSize != sizeof(FlightRecord)
+      || sizeof(FlightHeader) + size_t(hdr->capacity) * sizeof(FlightRecord)
+          > size_t(st.st_size)) {
+    cerr << fileName << ": not a flight recorder file" << endl;
+    return 1;
+  }
+
+  // Copy out so the writer can keep going while we sort
+  const FlightRecord *slots = (const FlightRecord *) (hdr + 1);
+  vector<FlightRecord> history;
+  history.reserve(hdr->capacity);
+  for (uint32_t i = 0; i < hdr->capacity; i++) {
+    FlightRecord rec = slots[i];
+    // Empty or torn slots
+    if (rec.seq == 0 || (rec.seq - 1) % hdr->capacity != i
+        || rec.seq != __atomic_load_n(&slots[i].seq, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    if (matches(rec)) {
+      history.push_back(rec);
+    }
+  }
+  sort(history.begin(), history.end(),
+      [](const FlightRecord &a, const FlightRecord &b) {
+        return a.seq < b.seq;
+      });
+
+  size_t first = (lastN && history.size() > lastN) ? history.size() - lastN : 0;
+  for (size_t i = first; i < history.size(); i++) {
+    print(history[i]);
+  }
+
+  munmap(map, st.st_size);
+  return 0;
+}
@@ -8,22 +8,74 @@
 #include <iomanip>
 #include <argp.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "libcec/cec.h"
 #include "libcec/cecloader.h"
 #include "lirc_client.h"
-#include "xbmcclient.h"
+#include "xbmcclient_mt.h"
+#include "cec-lirc.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "rules.h"
+#include "watchdog.h"
+#include "bridgestate.h"
+#include "dispatch.h"
+#include "profiles.h"
+#include "irsched.h"
+#include "lirctx.h"
+#include "dedupe.h"
+#include "audiostatus.h"
+#include "control.h"
+#include "cecadapter.h"
+#include "simbus.h"
+#include "cecsched.h"
+#include "statefile.h"
+#include "topology.h"
+#include "warmup.h"
+#include "soak.h"
+#include "kodirpc.h"
+#include "gesture.h"
+#include "alloccheck.h"
 
 using namespace std;
 using namespace CEC;
 
 // The main loop will just continue until a ctrl-C is received
 static bool exit_now = false;
-static int lircFd = -1;
-static uint32_t logMask = (CEC_LOG_ERROR | CEC_LOG_WARNING);
-static ICECAdapter *CECAdapter;
-static CXBMCClient xbmc;
+uint32_t logMask = (CEC_LOG_ERROR | CEC_LOG_WARNING);
+static ICECAdapter *libCec = nullptr;
+static CecAdapter *CECAdapter;
+// Called from several libcec callback threads
+static CXBMCClientMT xbmc;
+static const char *metricsAddr = nullptr;
+static const char *flightRecPath = FLIGHTREC_PATH;
+static const char *rulesPath = nullptr;
+static const char *stateName = BRIDGE_STATE_SHM;
+static const char *stateFilePath = STATE_FILE_PATH;
+static unsigned stateMaxAge = STATE_FILE_MAX_AGE;
+static unsigned budgetMs = 250;
+static DispatchOptions dispatchOptions = { 0, -1 };
+static bool lockMemory = false;
+static const char *profilesPath = nullptr;
+static const char *ampName = "amp";
+static int ampDevice = -1;
+static const char *controlPath = nullptr;
+static const char *simScript = nullptr;
+static unsigned queryBudget = 20;
+static unsigned warmupMs = 15000;
+static uint64_t soakEvents = 0;
+static const char *kodiRpcAddr = nullptr;
+static unsigned longPressMs = GESTURE_LONG_MS;
+static unsigned doublePressMs = GESTURE_DOUBLE_MS;
+static unsigned volumeTapMs = 100;
+
+// Time for the routing command behind a source deactivation to arrive
+#define SOURCE_SETTLE_NS 250000000ull
 
 //static CCECProcessor *m_processor;
 
@@ -34,6 +86,46 @@ const char *argp_program_bug_address = "https://github.com/ballle98/cec-lirc";
 static struct argp_option options[] = { { "verbose", 'v', 0, 0,
     "Produce verbose output" },
     { "quiet", 'q', 0, 0, "Don't produce any output" },
+    { "metrics", 'm', "ADDR", 0,
+    "Serve Prometheus metrics on a Unix socket path or [host:]port" },
+    { "flight-recorder", 'f', "FILE", 0,
+    "Flight recorder file (default " FLIGHTREC_PATH "), empty to disable" },
+    { "rules", 'r', "FILE", 0, "CEC command rules in front of the defaults" },
+    { "state", 's', "NAME", 0, "Shared memory segment for the bridge state "
+    "(default " BRIDGE_STATE_SHM "), empty to disable" },
+    { "state-file", 'F', "FILE", 0, "Keep the bridge state across restarts "
+    "in FILE (default " STATE_FILE_PATH "), empty to disable" },
+    { "state-max-age", 'A', "S", 0,
+    "Ignore a saved state older than S seconds (default 600)" },
+    { "budget", 'b', "MS", 0,
+    "Log callbacks running longer than MS milliseconds (default 250)" },
+    { "rt-priority", 'p', "N", 0,
+    "Run the IR/Kodi dispatch thread under SCHED_FIFO priority N" },
+    { "cpu", 'c', "N", 0, "Pin the IR/Kodi dispatch thread to core N" },
+    { "mlock", 'l', 0, 0, "Lock all memory after initialization" },
+    { "profiles", 'i', "FILE", 0,
+    "IR device profiles replacing or adding to the defaults" },
+    { "amp", 'a', "NAME", 0, "IR profile of the amplifier (default amp)" },
+    { "control", 'u', "PATH", 0, "Accept control requests on a Unix socket" },
+    { "simulate", 'S', "SCRIPT", 0,
+    "Run against a simulated CEC bus and lircd driven by SCRIPT" },
+    { "query-budget", 'Q', "PCT", 0,
+    "Share of the CEC bus time queries may use (default 20)" },
+    { "warm-up", 'w', "MS", 0, "Power the amp when the TV starts waking up, "
+    "off again if it is not on within MS (default 15000, 0 disables)" },
+    { "soak", 'k', "EVENTS", 0, "Drive EVENTS synthetic events through the "
+    "handlers against stand-ins, fail if memory, fds or latency grow" },
+    { "kodi-rpc", 'j', "ADDR", 0, "Follow Kodi's player and screensaver over "
+    "JSON-RPC at [host:]port (usually 9090) to skip needless stops and "
+    "notifications" },
+    { "long-press", 'L', "MS", 0, "Hold time of a long press on the coloured "
+    "keys (default 500, 0 disables)" },
+    { "double-press", 'D', "MS", 0, "Time for the second press of a double "
+    "select (default 300, 0 disables)" },
+    { "volume-tap", 'T', "MS", 0, "Volume presses released within MS are "
+    "sent as counted SEND_ONCE (default 100, 0 always repeats)" },
+    { "dedupe", 'E', "CLASS=MS", 0, "Drop repeated CEC frames of CLASS (key, "
+    "state, request, other or all) within MS (defaults 200, 500, 0, 100)" },
     { 0 } };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -44,6 +136,74 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case 'v':
     logMask = CEC_LOG_ALL;
     break;
+  case 'm':
+    metricsAddr = arg;
+    break;
+  case 'f':
+    flightRecPath = arg;
+    break;
+  case 'r':
+    rulesPath = arg;
+    break;
+  case 's':
+    stateName = arg;
+    break;
+  case 'F':
+    stateFilePath = arg;
+    break;
+  case 'A':
+    stateMaxAge = strtoul(arg, nullptr, 10);
+    break;
+  case 'b':
+    budgetMs = strtoul(arg, nullptr, 10);
+    break;
+  case 'p':
+    dispatchOptions.rtPriority = atoi(arg);
+    break;
+  case 'c':
+    dispatchOptions.cpu = atoi(arg);
+    break;
+  case 'l':
+    lockMemory = true;
+    break;
+  case 'i':
+    profilesPath = arg;
+    break;
+  case 'a':
+    ampName = arg;
+    break;
+  case 'u':
+    controlPath = arg;
+    break;
+  case 'S':
+    simScript = arg;
+    break;
+  case 'Q':
+    queryBudget = strtoul(arg, nullptr, 10);
+    break;
+  case 'w':
+    warmupMs = strtoul(arg, nullptr, 10);
+    break;
+  case 'k':
+    soakEvents = strtoull(arg, nullptr, 10);
+    break;
+  case 'j':
+    kodiRpcAddr = arg;
+    break;
+  case 'L':
+    longPressMs = strtoul(arg, nullptr, 10);
+    break;
+  case 'D':
+    doublePressMs = strtoul(arg, nullptr, 10);
+    break;
+  case 'T':
+    volumeTapMs = strtoul(arg, nullptr, 10);
+    break;
+  case 'E':
+    if (!dedupeParse(arg)) {
+      argp_error(state, "invalid --dedupe %s", arg);
+    }
+    break;
   default:
     return ARGP_ERR_UNKNOWN;
   }
@@ -70,245 +230,738 @@ void CECLogMessage(void *not_used, const cec_log_message *message) {
   }
 }
 
+// Book keeping common to every lircd and Kodi send
+static void irResult(MetricsBackend backend, bool ok, uint64_t start,
+    const char *detail) {
+  metricsBackend(backend, ok, start);
+  flightRecAction(FR_ACTION_IR, ok, detail);
+  stateCount(STATE_IR_SEND, ok);
+}
+
+static void kodiResult(bool ok, uint64_t start, const char *detail) {
+  metricsBackend(METRICS_KODI_SEND, ok, start);
+  flightRecAction(FR_ACTION_KODI, ok, detail);
+  stateCount(STATE_KODI_SEND, ok);
+}
+
 int send_packet(lirc_cmd_ctx *ctx, int fd) {
+  uint64_t start = metricsNow();
   int r;
+  watchdogStep("lirc_command_run", ctx->packet);
   do {
     r = lirc_command_run(ctx, fd);
     if (r != 0 && r != EAGAIN) {
-      cerr << "send_packet lirc_command_run Error " << strerror(r) << endl;
+      cerr << "send_packet lirc_command_run Error " << strerror(r) << '\n';
     }
   } while (r == EAGAIN);
+  irResult(METRICS_LIRC_SEND_PACKET, r == 0, start, ctx->packet);
   return r == 0 ? 0 : -1;
 }
 
-void xbmcKeyPress(const char *Button, unsigned int duration) {
+int send_one(int fd, const char *remote, const char *keysym) {
+  uint64_t start = metricsNow();
+  watchdogStep("lirc_send_one", keysym);
+  int r = lirc_send_one(fd, remote, keysym);
+
+  char detail[64];
+  snprintf(detail, sizeof(detail), "SEND_ONCE %s %s", remote, keysym);
+  irResult(METRICS_LIRC_SEND_ONE, r != -1, start, detail);
+  return r;
+}
+
+bool irTransmit(int fd, const IrProfile &profile, const char *keysym,
+    IrSendType type, unsigned count) {
+  // One per transmitter thread, the packet is the watchdog step detail
+  static thread_local lirc_cmd_ctx ctx;
+  const char *remote = profile.remote.c_str();
+
+  if (type == IR_SEND_ONCE && count > 1) {
+    // lircd sends the code once plus the given number of repeats
+    lirc_command_init(&ctx, "SEND_ONCE %s %s %u\n", remote, keysym,
+        count - 1);
+    return send_packet(&ctx, fd) == 0;
+  }
+  if (type == IR_SEND_ONCE) {
+    if (send_one(fd, remote, keysym) == -1) {
+      cerr << "irTransmit: lirc_send_one " << remote << " " << keysym
+          << " failed" << '\n';
+      return false;
+    }
+    return true;
+  }
+  lirc_command_init(&ctx, "%s %s %s\n",
+      type == IR_SEND_START ? "SEND_START" : "SEND_STOP", remote, keysym);
+  if (logMask & CEC_LOG_DEBUG) {
+    lirc_command_reply_to_stdout(&ctx);
+  }
+  return send_packet(&ctx, fd) == 0;
+}
+
+// Transmitter connections, stand-ins for the soak and simulated runs.  The
+// soak stand-in answers at once, it measures the bridge.
+static int lircConnect(const char *path) {
+  if (soakEvents) {
+    return simLircd(path, 0);
+  }
+  if (simScript) {
+    return simLircd(path, SIM_IR_MS);
+  }
+  return lirc_get_local_socket(path, 0);
+}
+
+// <Report Audio Status> from the amp model, a reply to the requester or
+// an unsolicited state report to the TV after a volume key
+void reportAudioStatus(cec_logical_address destination,
+    CecPriority priority) {
+  cec_command command;
+  cec_command::Format(command, CECDEVICE_AUDIOSYSTEM, destination,
+      CEC_OPCODE_REPORT_AUDIO_STATUS);
+  command.PushBack(audioStatus());
+  cecQueueTransmit(command, priority, "REPORT_AUDIO_STATUS");
+}
+
+void cecFeatureAbort(const cec_command *command, cec_abort_reason reason) {
+  cec_command abort;
+  cec_command::Format(abort, command->destination, command->initiator,
+      CEC_OPCODE_FEATURE_ABORT);
+  abort.PushBack(command->opcode);
+  abort.PushBack(reason);
+  cecQueueTransmit(abort, CEC_PRIO_REPLY, "FEATURE_ABORT");
+}
+
+// <Report Short Audio Descriptor> with the amp SADs for exactly the
+// formats asked for, <Feature Abort> [Invalid Operand] if none is supported
+void reportShortAudioDescriptors(const cec_command *command) {
+  uint8_t sads[4][3];
+  unsigned n = profileSads(ampDevice, command->parameters.data,
+      command->parameters.size, sads);
+
+  if (n == 0) {
+    cecFeatureAbort(command, CEC_ABORT_REASON_INVALID_OPERAND);
+    return;
+  }
+  cec_command report;
+  cec_command::Format(report, CECDEVICE_AUDIOSYSTEM, command->initiator,
+      CEC_OPCODE_REPORT_SHORT_AUDIO_DESCRIPTORS);
+  for (unsigned i = 0; i < n; i++) {
+    for (unsigned j = 0; j < 3; j++) {
+      report.PushBack(sads[i][j]);
+    }
+  }
+  cecQueueTransmit(report, CEC_PRIO_REPLY,
+      "REPORT_SHORT_AUDIO_DESCRIPTORS");
+}
+
+// The watchdog keeps its detail pointer, title must outlive the process
+// unless a static detail is given
+bool kodiNotification(const char *title, const char *detail = nullptr) {
+  uint64_t start = metricsNow();
+  watchdogStep("kodi notification", detail ? detail : title);
+  bool ok = xbmc.SendNOTIFICATION(title, "CEC Remote", ICON_NONE);
+  kodiResult(ok, start, title);
+  return ok;
+}
+
+// Single shot button not tied to a CEC key, detail as for
+// kodiNotification()
+bool kodiButton(const char *Button, const char *detail = nullptr) {
+  uint64_t start = metricsNow();
+  watchdogStep("kodi button", detail ? detail : Button);
+  bool ok = xbmc.SendButton(Button, "R1", BTN_NO_REPEAT);
+  kodiResult(ok, start, Button);
+  return ok;
+}
+
+void kodiStop() {
+  // Stop in the menus still wakes the screensaver
+  if (kodiRpcPlayer() == KODI_PLAYER_STOPPED) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "Kodi is not playing, no stop" << '\n';
+    return;
+  }
+  (logMask & CEC_LOG_DEBUG)
+       && cout << "Stop Kodi playback" << '\n';
+  kodiButton("stop");
+}
+
+// Volume feedback on Kodi's screen, a notification would end the
+// screensaver for nobody watching
+static void volumeNotification(const char *title) {
+  if (kodiRpcScreensaver()) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "Kodi screensaver active, no " << title << '\n';
+    return;
+  }
+  kodiNotification(title);
+}
+
+void xbmcKeyPress(const char *Button, const cec_keypress *key) {
+  unsigned int duration = key->duration;
   (logMask & CEC_LOG_DEBUG)
       && cout << "xbmcKeyPress: " <<  Button <<
-      " duration " << dec << unsigned(duration) << endl;
+      " duration " << dec << unsigned(duration) << '\n';
 
+  uint64_t start = metricsNow();
+  bool ok;
+  watchdogStep("kodi button", Button);
   if (duration == 0) { // key down
-    xbmc.SendButton(Button, "R1", BTN_DOWN);
+    ok = xbmc.SendButton(Button, "R1", BTN_DOWN);
   } else {
-    xbmc.SendButton(0x01, BTN_UP);
+    ok = xbmc.SendButton(0x01, BTN_UP);
   }
+  kodiResult(ok, start, duration == 0 ? Button : "release");
 }
 
-void CECKeyPress(void *cbParam, const cec_keypress *key) {
-  static lirc_cmd_ctx ctx;
+// Volume keys.  A press is held back for up to volumeTapMs: released by
+// then it was a tap and goes out as SEND_ONCE, merged with taps still
+// queued for the amp (irSendBatch()), otherwise SEND_START repeats the
+// code until the release.  A tap costs one lircd round trip instead of
+// two and the first press waits volumeTapMs at most.
+struct VolumeKey {
+  int timer;            // tap window, -1 when not armed
+  bool up;
+  bool held;            // pressed and not released yet
+  bool repeating;       // SEND_START went out
+  unsigned heldBackMs;  // of the hold time before SEND_START
+};
 
-  (logMask & CEC_LOG_DEBUG)
-      && cout << "CECKeyPress: key " << hex << unsigned(key->keycode)
-          << " duration " << dec << unsigned(key->duration) << endl;
+static VolumeKey volumeKey = { -1, false, false, false, 0 };
+
+static IrKey volumeIrKey(bool up) {
+  return up ? IR_VOLUME_UP : IR_VOLUME_DOWN;
+}
+
+static void volumeRepeat(bool up) {
+  if (irSendKey(ampDevice, volumeIrKey(up), IR_SEND_START)) {
+    volumeKey.repeating = true;
+    audioVolumePressed(up);
+    reportAudioStatus(CECDEVICE_TV, CEC_PRIO_STATE);
+  }
+}
+
+// The tap window closed with the key still down
+static void volumeHeld(void *arg) {
+  WatchdogScope scope("volume hold");
+  volumeKey.timer = -1;
+  volumeRepeat(volumeKey.up);
+}
+
+static void volumeReleased(bool up, unsigned durationMs) {
+  // A release without its press has nothing to end
+  if (!volumeKey.held || volumeKey.up != up) {
+    return;
+  }
+  volumeKey.held = false;
+  if (volumeKey.timer >= 0) {
+    dispatchCancel(volumeKey.timer);
+    volumeKey.timer = -1;
+    if (irSendBatch(ampDevice, volumeIrKey(up))) {
+      audioVolumePressed(up);
+      reportAudioStatus(CECDEVICE_TV, CEC_PRIO_STATE);
+    }
+  } else if (volumeKey.repeating) {
+    volumeKey.repeating = false;
+    if (irSendKey(ampDevice, volumeIrKey(up), IR_SEND_STOP)) {
+      audioVolumeReleased(up, durationMs > volumeKey.heldBackMs
+          ? durationMs - volumeKey.heldBackMs : 0);
+      reportAudioStatus(CECDEVICE_TV, CEC_PRIO_STATE);
+    }
+  }
+}
+
+static void volumePressed(bool up) {
+  if (volumeKey.held) {
+    // Repeated press of the held key, or the other one without a release
+    if (volumeKey.up == up) {
+      return;
+    }
+    volumeReleased(volumeKey.up, 0);
+  }
+  volumeKey.up = up;
+  volumeKey.held = true;
+  volumeKey.repeating = false;
+  volumeKey.heldBackMs = volumeTapMs;
+  if (volumeTapMs) {
+    volumeKey.timer = dispatchTimer(volumeTapMs * 1000000ull, volumeHeld,
+        nullptr);
+  }
+  if (volumeKey.timer < 0) {
+    volumeKey.heldBackMs = 0;
+    volumeRepeat(up);
+  }
+}
+
+// The bridge's action for a key, false if the key has none
+static bool keyAction(const cec_keypress *key) {
+  bool known = true;
 
   switch (key->keycode) {
   case CEC_USER_CONTROL_CODE_SELECT: //0x00
-    xbmcKeyPress("select", key->duration);
+    xbmcKeyPress("select", key);
     break;
   case CEC_USER_CONTROL_CODE_UP: //0x01
-    xbmcKeyPress("up", key->duration);
+    xbmcKeyPress("up", key);
     break;
   case CEC_USER_CONTROL_CODE_DOWN: //0x02
-    xbmcKeyPress("down", key->duration);
+    xbmcKeyPress("down", key);
     break;
   case CEC_USER_CONTROL_CODE_LEFT: //0x03
-    xbmcKeyPress("left", key->duration);
+    xbmcKeyPress("left", key);
     break;
   case CEC_USER_CONTROL_CODE_RIGHT: //0x04
-    xbmcKeyPress("right", key->duration);
+    xbmcKeyPress("right", key);
     break;
   case CEC_USER_CONTROL_CODE_EXIT: //0x0D
-    xbmcKeyPress("back", key->duration);
+    xbmcKeyPress("back", key);
     break;
   case CEC_USER_CONTROL_CODE_VOLUME_UP: //0x41
     if (key->duration == 0) { // key pressed
-      lirc_command_init(&ctx, "SEND_START Yamaha_RAV283 KEY_VOLUMEUP\n");
-      xbmc.SendNOTIFICATION("Volume Up", "CEC Remote", ICON_NONE);
+      volumePressed(true);
+      volumeNotification("Volume Up");
     } else {
-      lirc_command_init(&ctx, "SEND_STOP Yamaha_RAV283 KEY_VOLUMEUP\n");
+      volumeReleased(true, key->duration);
     }
-    if (logMask & CEC_LOG_DEBUG) {
-      lirc_command_reply_to_stdout(&ctx);
-    }
-    send_packet(&ctx, lircFd);
     break;
   case CEC_USER_CONTROL_CODE_VOLUME_DOWN: //0x42
     if (key->duration == 0) { // key pressed
-      lirc_command_init(&ctx, "SEND_START Yamaha_RAV283 KEY_VOLUMEDOWN\n");
-      xbmc.SendNOTIFICATION("Volume Down", "CEC Remote", ICON_NONE);
+      volumePressed(false);
+      volumeNotification("Volume Down");
     } else {
-      lirc_command_init(&ctx, "SEND_STOP Yamaha_RAV283 KEY_VOLUMEDOWN\n");
-    }
-    if (logMask & CEC_LOG_DEBUG) {
-      lirc_command_reply_to_stdout(&ctx);
+      volumeReleased(false, key->duration);
     }
-    send_packet(&ctx, lircFd);
     break;
   case CEC_USER_CONTROL_CODE_MUTE: //0x43
     if (key->duration == 0) { // key pressed
-      if (lirc_send_one(lircFd, "Yamaha_RAV283", "KEY_MUTE") == -1) {
-        cerr << "CECKeyPress: lirc_send_one KEY_MUTE failed" << endl;
+      if (irSendKey(ampDevice, IR_MUTE)) {
+        audioMuteToggled();
+        reportAudioStatus(CECDEVICE_TV, CEC_PRIO_STATE);
       }
-      xbmc.SendNOTIFICATION("Mute", "CEC Remote", ICON_NONE);
+      volumeNotification("Mute");
     }
     break;
   case CEC_USER_CONTROL_CODE_F1_BLUE: //0x71
-    xbmcKeyPress("info", key->duration);
+    xbmcKeyPress("info", key);
     break;
   case CEC_USER_CONTROL_CODE_F2_RED: //0x72
-    xbmcKeyPress("menu", key->duration);
+    xbmcKeyPress("menu", key);
     break;
   case CEC_USER_CONTROL_CODE_F3_GREEN: //0x73
-    xbmcKeyPress("display", key->duration);
+    xbmcKeyPress("display", key);
     break;
   case CEC_USER_CONTROL_CODE_F4_YELLOW: //0x74
-    xbmcKeyPress("title", key->duration);
+    xbmcKeyPress("title", key);
     break;
   default:
     (logMask & CEC_LOG_DEBUG)
-        && cout << "unknown key " << hex << unsigned(key->keycode) << endl;
+        && cout << "unknown key " << hex << unsigned(key->keycode) << '\n';
+    known = false;
     break;
   }
-
+  return known;
 }
 
-void turnAudioOn() {
+void handleKeyPress(const cec_keypress *key) {
+  if (dedupeKeyPress(key)) {
+    return;
+  }
+  WatchdogScope scope("CECKeyPress");
+  uint64_t start = metricsNow();
+
   (logMask & CEC_LOG_DEBUG)
-      && cout << "turnAudioOn: lirc_send_one KEY_POWER" << endl;
-  if (lirc_send_one(lircFd, "Yamaha_RAV283", "KEY_POWER") == -1) {
-    cerr << "turnAudioOn: lirc_send_one KEY_POWER failed" << endl;
+      && cout << "CECKeyPress: key " << hex << unsigned(key->keycode)
+          << " duration " << dec << unsigned(key->duration) << '\n';
+  stateKeyPress(key->keycode);
+
+  // Keys with a gesture are handled once it is known
+  bool known = gestureKey(key) || keyAction(key);
+  metricsKeyPress(key->keycode, known, start);
+}
+
+void handleGesture(const cec_keypress *key, const char *button) {
+  if (button) {
+    kodiButton(button);
+  } else {
+    keyAction(key);
   }
-  CECAdapter->AudioEnable(true);
-  CECAdapter->PowerOnDevices((cec_logical_address) CEC_DEVICE_TYPE_AUDIO_SYSTEM);
+}
+
+void turnAudioOn() {
+  uint64_t start = metricsNow();
+  flightRecAction(FR_ACTION_AUDIO_ON, true, nullptr);
+  stateAmp(true);
+  (logMask & CEC_LOG_DEBUG) && cout << "turnAudioOn: IR power on" << '\n';
+  warmupAudioOn();
+  cecQueueAudioEnable(true);
+  cecQueuePowerOn((cec_logical_address) CEC_DEVICE_TYPE_AUDIO_SYSTEM);
+  metricsAudio(METRICS_AUDIO_ON, start);
 }
 
 void turnAudioOff() {
-  (logMask & CEC_LOG_DEBUG)
-      && cout << "turnAudioOff CECCommand: lirc_send_one KEY_SUSPEND" << endl;
-  if (lirc_send_one(lircFd, "Yamaha_RAV283", "KEY_SUSPEND") == -1) {
-    cerr << "turnAudioOff: lirc_send_one KEY_SUSPEND failed" << endl;
-  }
+  uint64_t start = metricsNow();
+  flightRecAction(FR_ACTION_AUDIO_OFF, true, nullptr);
+  stateAmp(false);
+  (logMask & CEC_LOG_DEBUG) && cout << "turnAudioOff: IR power off" << '\n';
+  warmupAudioOff();
   // :TODO: CCECAudioSystem::SetSystemAudioModeStatus
-  CECAdapter->StandbyDevices((cec_logical_address) CEC_DEVICE_TYPE_AUDIO_SYSTEM);
-  CECAdapter->AudioEnable(false);
+  cecQueueStandby((cec_logical_address) CEC_DEVICE_TYPE_AUDIO_SYSTEM);
+  cecQueueAudioEnable(false);
 
-  (logMask & CEC_LOG_DEBUG)
-       && cout << "Stop Kodi playback" << endl;
-  xbmc.SendButton("stop", "R1", BTN_NO_REPEAT);
+  kodiStop();
+  metricsAudio(METRICS_AUDIO_OFF, start);
 }
 
-void CECCommand(void *cbParam, const cec_command *command) {
-  (logMask & CEC_LOG_DEBUG)
-      && cout << "CECCommand: opcode " << hex << unsigned(command->opcode)
-          << " " << unsigned(command->initiator) << " -> "
-          << unsigned(command->destination) << endl;
+static void deferredAudioOn(void *arg) {
+  WatchdogScope scope("turnAudioOn");
+  turnAudioOn();
+}
+
+static void deferredAudioOff(void *arg) {
+  cecQueueAudioEnable(false);
+}
+
+// <System Audio Mode Request> fast path.  Broadcast <Set System Audio Mode>
+// straight away, [On] when the request carries a physical address and
+// [Off] when it asks to end system audio, and power the amp from a dispatch
+// timer so the TV is not kept waiting for the IR round trip.
+void systemAudioRequest(const cec_command *command) {
+  bool on = command->parameters.size >= 2;
+  cec_command reply;
+
+  cec_command::Format(reply, CECDEVICE_AUDIOSYSTEM, CECDEVICE_BROADCAST,
+      CEC_OPCODE_SET_SYSTEM_AUDIO_MODE);
+  reply.PushBack(on ? 1 : 0);
+  const char *detail = on ? "SET_SYSTEM_AUDIO_MODE on"
+      : "SET_SYSTEM_AUDIO_MODE off";
+  if (!cecQueueTransmit(reply, CEC_PRIO_REPLY, detail)) {
+    // The TV asks again, the amp is switched all the same
+    cerr << "systemAudioRequest: cannot queue " << detail << '\n';
+    flightRecAction(FR_ACTION_CEC, false, detail);
+  }
+
+  DispatchTimerFn fn = on ? deferredAudioOn : deferredAudioOff;
+  if (dispatchTimer(0, fn, nullptr) < 0) {
+    fn(nullptr);
+  }
+}
+
+// Power sync waiting for its answers from the transmit queue
+struct PowerSync {
+  cec_logical_address address;
   cec_power_status power;
   cec_power_status tvPower;
+  unsigned pending;
+};
+static PowerSync powerSync = { CECDEVICE_UNKNOWN, CEC_POWER_STATUS_UNKNOWN,
+    CEC_POWER_STATUS_UNKNOWN, 0 };
 
-  switch (command->opcode) {
-  case CEC_OPCODE_STANDBY: //0x36 0f:36
-    if (command->initiator == (cec_logical_address)CEC_DEVICE_TYPE_TV){
-      turnAudioOff();
-    }
+static void powerSyncAnswer(cec_logical_address address,
+    cec_power_status power) {
+  if (address == powerSync.address) {
+    powerSync.power = power;
+  }
+  if (address == CECDEVICE_TV) {
+    powerSync.tvPower = power;
+  }
+  if (--powerSync.pending) {
+    return;
+  }
+
+  WatchdogScope scope("syncAudioPower");
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "Power Status(" << CECAdapter->ToString(powerSync.address)
+      << "): " << CECAdapter->ToString(powerSync.power) << " TV Power: " <<
+      CECAdapter->ToString(powerSync.tvPower) << '\n';
+  statePower(powerSync.address, powerSync.power);
+  statePower(CECDEVICE_TV, powerSync.tvPower);
+
+  if ((powerSync.tvPower == CEC_POWER_STATUS_ON)
+      && (powerSync.power == CEC_POWER_STATUS_ON)) {
+    turnAudioOn();
+  } else if (powerSync.power == CEC_POWER_STATUS_STANDBY) {
+    turnAudioOff();
+  }
+}
+
+// Follow the power status of the addressed device.
+// TV(0) -> Audio(5): give device power status (8F)
+// Audio(5) --> TV(0): on
+// The queries go through the transmit queue and the answers are handled
+// by powerSyncAnswer(), other events are not kept waiting for the bus.
+void syncAudioPower(const cec_command *command) {
+  // The answers to a sync still running will do for this one as well
+  if (powerSync.pending) {
+    return;
+  }
+  powerSync.address = command->destination;
+  powerSync.power = CEC_POWER_STATUS_UNKNOWN;
+  powerSync.tvPower = CEC_POWER_STATUS_UNKNOWN;
+  // The answers run on this thread, so after the queries are counted
+  unsigned queries = command->destination != CECDEVICE_TV ? 2 : 1;
+  if (cecQueuePowerStatus(command->destination, powerSyncAnswer)) {
+    powerSync.pending++;
+  }
+  if (queries == 2 && cecQueuePowerStatus(CECDEVICE_TV, powerSyncAnswer)) {
+    powerSync.pending++;
+  }
+  if (powerSync.pending < queries) {
+    // A missing answer stays unknown, with none the sync is dropped
+    cerr << "syncAudioPower: cannot queue "
+        << queries - powerSync.pending << " of " << queries
+        << " power status queries" << '\n';
+    flightRecAction(FR_ACTION_CEC, false, "sync-power queries");
+  }
+}
+
+// Returns false when the remaining actions of the rule are to be skipped
+bool runRuleAction(const RuleAction &action, const cec_command *command) {
+  switch (action.type) {
+  case RULE_IGNORE:
+    break;
+  case RULE_AUDIO_ON:
+    turnAudioOn();
     break;
-  case CEC_OPCODE_USER_CONTROL_PRESSED: // 0x44
+  case RULE_AUDIO_OFF:
+    turnAudioOff();
     break;
-  case CEC_OPCODE_USER_CONTROL_RELEASE: // 0x45
+  case RULE_SYNC_POWER:
+    syncAudioPower(command);
     break;
-  case CEC_OPCODE_SYSTEM_AUDIO_MODE_REQUEST: // 0x70  05:70:00:00
-    // From https://www.hdmi.org/docs/Hdmi13aSpecs
-    //
-    // The amplifier comes out of standby (if necessary) and switches to the
-    // relevant connector for device specified by [Physical Address]. It then
-    // sends a <Set System Audio Mode> [On] message.
-    //
-    // <System Audio Mode Request> sent without a [Physical Address]
-    // parameter requests termination of the feature. In this case, the
-    // amplifier sends a <Set System Audio Mode> [Off] message.
-    turnAudioOn();
-    // libCEC should return 50:72:01 (on) or 50:72:00 (off)
+  case RULE_KODI_STOP:
+    kodiStop();
     break;
-  case CEC_OPCODE_SYSTEM_AUDIO_MODE_STATUS: // 0x7E
+  case RULE_KODI_BUTTON:
+    kodiButton(action.arg.c_str());
     break;
-  case CEC_OPCODE_ROUTING_CHANGE: // 0x80
-    if (command->initiator == (cec_logical_address)CEC_DEVICE_TYPE_TV) {
-      // TV is on turn audio on
-      turnAudioOn();
+  case RULE_NOTIFY:
+    kodiNotification(action.arg.c_str());
+    break;
+  case RULE_IR: {
+    // ir:<key> for the amp or ir:<profile>:<key>
+    int device = ampDevice;
+    const char *keysym = action.arg.c_str();
+    const char *colon = strchr(keysym, ':');
+    if (colon) {
+      device = profileFind(keysym, colon - keysym);
+      keysym = colon + 1;
+    }
+    if (!irSend(device, keysym)) {
+      cerr << "runRuleAction: cannot send ir:" << action.arg << '\n';
     }
     break;
-  case CEC_OPCODE_ACTIVE_SOURCE: // 0x82
+  }
+  case RULE_AUDIO_STATUS:
+    reportAudioStatus(command->initiator, CEC_PRIO_REPLY);
     break;
-  case CEC_OPCODE_SET_STREAM_PATH: // 0x86
+  case RULE_AUDIO_DESCRIPTORS:
+    reportShortAudioDescriptors(command);
     break;
-  case CEC_OPCODE_VENDOR_COMMAND: //0x89
+  case RULE_SYSTEM_AUDIO:
+    systemAudioRequest(command);
     break;
-  case CEC_OPCODE_GIVE_DEVICE_POWER_STATUS: //0x8F
-    // User changes source (This implies that the TV is on)
-    // TV(0) -> Audio(5): give device power status (8F)
-    // Audio(5) --> TV(0): on
-    power = CECAdapter->GetDevicePowerStatus(command->destination);
-    tvPower = CECAdapter->GetDevicePowerStatus((cec_logical_address)CEC_DEVICE_TYPE_TV);
-    (logMask & CEC_LOG_DEBUG)
-        && cout << "Power Status(" <<  CECAdapter->ToString(command->destination)
-        << "): " << CECAdapter->ToString(power) << " TV Power: " <<
-        CECAdapter->ToString(tvPower) << endl;
-
-    if (command->destination ==
-        (cec_logical_address)CEC_DEVICE_TYPE_AUDIO_SYSTEM) {
-      if ((tvPower == CEC_POWER_STATUS_ON) && (power == CEC_POWER_STATUS_ON)) {
-        turnAudioOn();
-      } else if (power == CEC_POWER_STATUS_STANDBY) {
-        turnAudioOff();
-      }
+  case RULE_WARM_UP: {
+    char reason[16];
+    snprintf(reason, sizeof(reason), "opcode %02x", command->opcode);
+    warmupStart(reason);
+    break;
+  }
+  case RULE_OUR_ROUTE: {
+    uint16_t route = topologyRouteOf(command);
+    if (!topologyOnOurBranch(route)) {
+      (logMask & CEC_LOG_DEBUG)
+          && cout << "runRuleAction: route " << hex << route
+              << " is not on our branch" << '\n';
+      return false;
     }
     break;
-  case CEC_OPCODE_REPORT_POWER_STATUS: // 0x90
-    if (command->initiator == (cec_logical_address)CEC_DEVICE_TYPE_TV) {
-      if (command->parameters.data[0] == CEC_POWER_STATUS_ON) {
-        turnAudioOn();
-      }
-      else if (command->parameters.data[0] == CEC_POWER_STATUS_STANDBY) {
-        turnAudioOff();
+  }
+  }
+  return true;
+}
+
+void handleCommand(const cec_command *command) {
+  if (dedupeCommand(command)) {
+    return;
+  }
+  uint64_t start = metricsNow();
+  WatchdogScope scope("CECCommand");
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "CECCommand: opcode " << hex << unsigned(command->opcode)
+          << " " << unsigned(command->initiator) << " -> "
+          << unsigned(command->destination) << '\n';
+  stateCommand(command->initiator, command->opcode, command->parameters.data,
+      command->parameters.size);
+  topologyCommand(command);
+
+  RuleMatch match;
+  if (rulesMatch(command, match)) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "CECCommand: rule " << match.source << ":" << dec
+            << match.line << '\n';
+    for (unsigned i = 0; i < match.count; i++) {
+      if (!runRuleAction(match.actions[i], command)) {
+        break;
       }
     }
-    break;
-  case CEC_OPCODE_REQUEST_SHORT_AUDIO_DESCRIPTORS:  // 0xA4
-    break;
-  default:
-    break;
   }
+
+  metricsCecCommand(command->opcode, start);
 }
 
-void CECAlert(void *cbParam, const libcec_alert type,
-    const libcec_parameter param) {
+void handleAlert(const libcec_alert type) {
+  WatchdogScope scope("CECAlert");
 
   (logMask & CEC_LOG_DEBUG)
-      && cout << "CECAlert: type " << hex << unsigned(type) << endl;
+      && cout << "CECAlert: type " << hex << unsigned(type) << '\n';
 
   switch (type) {
   case CEC_ALERT_CONNECTION_LOST:
-    cout << "Connection lost" << endl;
+    cout << "Connection lost" << '\n';
     break;
   default:
     break;
   }
 }
 
-void CECSourceActivated(void* cbParam, const cec_logical_address
-    logicalAddress, const uint8_t bActivated) {
+// libcec reports the deactivation before the command that moved the route,
+// look where it went once that was handled
+static void deferredSourceLost(void *arg) {
+  uint16_t path = topologyActivePath();
+  BridgeState s;
+
+  if (path == TOPOLOGY_UNKNOWN && stateSnapshot(s)
+      && s.activeSource != BRIDGE_UNKNOWN) {
+    path = topologyPhysical(cec_logical_address(s.activeSource));
+  }
+  // Another of our logical addresses or a device behind us took over
+  if (topologyRoutedToUs(path)) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "CECSourceActivated: still routed to us" << '\n';
+    return;
+  }
+  kodiStop();
+}
+
+void handleSourceActivated(const cec_logical_address logicalAddress,
+    const uint8_t bActivated) {
+  WatchdogScope scope("CECSourceActivated");
 
   (logMask & CEC_LOG_DEBUG)
       && cout << "CECSourceActivated: LA=" << unsigned(logicalAddress) <<
-      " activated=" << unsigned(bActivated) << endl;
+      " activated=" << unsigned(bActivated) << '\n';
+  stateActiveSource(logicalAddress, bActivated);
 
   if ((logicalAddress ==
       (cec_logical_address)CEC_DEVICE_TYPE_AUDIO_SYSTEM)  && (!bActivated)){
-    (logMask & CEC_LOG_DEBUG)
-        && cout << "Stop Kodi playback" << endl;
-    xbmc.SendButton("stop", "R1", BTN_NO_REPEAT);
+    if (dispatchTimer(SOURCE_SETTLE_NS, deferredSourceLost, nullptr) < 0) {
+      kodiStop();
+    }
   }
 
 }
 
+void handleControl(ControlRequest *request) {
+  WatchdogScope scope("handleControl");
+
+  switch (request->type) {
+  case CONTROL_IR:
+    request->ok = irSend(request->device, request->keysym);
+    break;
+  case CONTROL_CEC:
+    request->ok = cecTransmitWait(request->command, CEC_PRIO_STATE,
+        "control");
+    break;
+  case CONTROL_KODI:
+    request->ok = kodiButton(request->text, "control");
+    break;
+  case CONTROL_NOTIFY:
+    request->ok = kodiNotification(request->text, "control");
+    break;
+  }
+}
+
+// libcec callbacks, record the event and hand it to the dispatch thread
+void CECKeyPress(void *cbParam, const cec_keypress *key) {
+  AllocScope scope(ALLOC_CALLBACK);
+  flightRecKeyPress(key->keycode, key->duration);
+  dispatchKeyPress(key);
+}
+
+void CECCommand(void *cbParam, const cec_command *command) {
+  AllocScope scope(ALLOC_CALLBACK);
+  flightRecCommand(command->initiator, command->destination, command->opcode,
+      command->parameters.data, command->parameters.size);
+  dispatchCommand(command);
+}
+
+void CECAlert(void *cbParam, const libcec_alert type,
+    const libcec_parameter param) {
+  AllocScope scope(ALLOC_CALLBACK);
+  flightRecAlert(type);
+  dispatchAlert(type);
+}
+
+void CECSourceActivated(void* cbParam, const cec_logical_address
+    logicalAddress, const uint8_t bActivated) {
+  AllocScope scope(ALLOC_CALLBACK);
+  flightRecSource(logicalAddress, bActivated);
+  dispatchSource(logicalAddress, bActivated);
+}
+
+// Load libcec and open the first adapter found
+static CecAdapter *openLibCec(libcec_configuration *config) {
+  if (!(libCec = LibCecInitialise(config))) {
+    cerr << "LibCecInitialise failed" << endl;
+    return nullptr;
+  }
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "*** LibCecInitialise complete ***" << endl;
+
+  array<cec_adapter_descriptor, 10> devices;
+
+  (logMask & CEC_LOG_DEBUG) && cout << "*** DetectAdapters start ***" << endl;
+
+  int8_t devices_found = libCec->DetectAdapters(devices.data(),
+      devices.size(), nullptr, false);
+  if (devices_found <= 0) {
+    cerr << "Could not automatically determine the cec adapter devices" << endl;
+    UnloadLibCec(libCec);
+    return nullptr;
+  }
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << unsigned(devices_found) << " devices found" << endl;
+
+  // Open a connection to the zeroth CEC device
+  if (!libCec->Open(devices[0].strComName)) {
+    cerr << "Failed to open the CEC device on port " << devices[0].strComName
+        << endl;
+    UnloadLibCec(libCec);
+    return nullptr;
+  }
+  return new LibCecAdapter(libCec);
+}
+
+// Ends the libcec callbacks, after flushing what is queued while the
+// adapter is still open
+static void stopAdapter() {
+  static bool stopped = false;
+
+  if (stopped) {
+    return;
+  }
+  stopped = true;
+  cecSchedStop();
+  CECAdapter->Close();
+}
+
+static void closeAdapter() {
+  stopAdapter();
+  if (libCec) {
+    UnloadLibCec(libCec);
+  }
+}
+
 int main(int argc, char *argv[]) {
   ICECCallbacks CECCallbacks;
   libcec_configuration CECConfig;
@@ -320,18 +973,58 @@ int main(int argc, char *argv[]) {
     cerr << "Failed to install the SIGINT signal handler\n";
     return 1;
   }
+  // systemd stops the service with SIGTERM
+  if ( SIG_ERR == signal(SIGTERM, handle_signal)) {
+    cerr << "Failed to install the SIGTERM signal handler\n";
+    return 1;
+  }
 
-  lircFd = lirc_get_local_socket("/var/run/lirc/lircd-tx", 0);
-  if (lircFd < 0) {
-    cerr << "Failed to get LIRC local socket" << endl;
+  watchdogInit(budgetMs);
+
+  if (!rulesLoad(rulesPath)) {
     return 1;
   }
 
-  (logMask & CEC_LOG_DEBUG)
-      && cout << "lirc_get_local_socket " << lircFd << endl;
+  if (!profilesLoad(profilesPath)) {
+    return 1;
+  }
+  ampDevice = profileFind(ampName);
+  if (ampDevice < 0) {
+    cerr << "No IR profile named " << ampName << endl;
+    return 1;
+  }
+  warmupInit(ampDevice, warmupMs);
+  gestureInit(longPressMs, doublePressMs);
+
+  if (metricsAddr && !metricsStart(metricsAddr)) {
+    return 1;
+  }
+
+  // The recorder is best effort, the bridge still runs without it
+  if (flightRecPath[0]) {
+    flightRecOpen(flightRecPath);
+  }
+  // An empty name still keeps the state for the state file
+  stateOpen(stateName);
+  if (stateFilePath[0]) {
+    stateFileLoad(stateFilePath, stateMaxAge);
+  }
+  // After stateOpen() so the estimate is published from the start
+  audioStatusInit(ampDevice);
+
+  if (!lircTxStart(lircConnect)) {
+    cerr << "Failed to get LIRC local socket" << endl;
+    return 1;
+  }
 
   xbmc.SendHELO("cec-lirc remote", ICON_NONE);
 
+  topologyInit();
+
+  // Before libcec starts calling back
+  if (!dispatchStart(dispatchOptions)) {
+    return 1;
+  }
 
   CECConfig.Clear();
   CECCallbacks.Clear();
@@ -351,61 +1044,92 @@ int main(int argc, char *argv[]) {
   CECConfig.deviceTypes.Add(CEC_DEVICE_TYPE_AUDIO_SYSTEM);
   CECConfig.deviceTypes.Add(CEC_DEVICE_TYPE_PLAYBACK_DEVICE);
 
-  if (!(CECAdapter = LibCecInitialise(&CECConfig))) {
-    cerr << "LibCecInitialise failed" << endl;
+  if (soakEvents) {
+    if (!(CECAdapter = soakOpen(&CECCallbacks, nullptr))) {
+      return 1;
+    }
+  } else if (simScript) {
+    if (!(CECAdapter = simOpen(simScript, &CECCallbacks, nullptr))) {
+      return 1;
+    }
+  } else if (!(CECAdapter = openLibCec(&CECConfig))) {
     return 1;
   }
+  (logMask & CEC_LOG_DEBUG) && cout << "*** CEC device opened ***" << endl;
 
-  (logMask & CEC_LOG_DEBUG)
-      && cout << "*** LibCecInitialise complete ***" << endl;
+  // libcec knows its own address, no bus traffic
+  topologySetSelf(CECAdapter->GetDevicePhysicalAddress(CECDEVICE_AUDIOSYSTEM));
 
-  array<cec_adapter_descriptor, 10> devices;
+  if (!cecSchedStart(CECAdapter, queryBudget)) {
+    closeAdapter();
+    return 1;
+  }
 
-  (logMask & CEC_LOG_DEBUG) && cout << "*** DetectAdapters start ***" << endl;
+  if (logMask & CEC_LOG_DEBUG) {
+    cec_version audioCecVer = cecVersion(CECDEVICE_AUDIOSYSTEM);
+    cout << "Audio CEC Version 0x" << hex << audioCecVer << endl;
+  }
 
-  int8_t devices_found = CECAdapter->DetectAdapters(devices.data(),
-      devices.size(), nullptr, false);
-  if (devices_found <= 0) {
-    cerr << "Could not automatically determine the cec adapter devices" << endl;
-    UnloadLibCec(CECAdapter);
-    return 1;
+  // libcec and the dispatch thread are up, keep everything resident so an
+  // IR send never waits for a page fault
+  if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    cerr << "mlockall: " << strerror(errno) << endl;
   }
 
-  (logMask & CEC_LOG_DEBUG)
-      && cout << unsigned(devices_found) << " devices found" << endl;
+  // After simOpen(), the simulated bus may serve the JSON-RPC port
+  if (kodiRpcAddr && !kodiRpcStart(kodiRpcAddr)) {
+    closeAdapter();
+    return 1;
+  }
 
-  // Open a connection to the zeroth CEC device
-  if (!CECAdapter->Open(devices[0].strComName)) {
-    cerr << "Failed to open the CEC device on port " << devices[0].strComName
-        << endl;
-    UnloadLibCec(CECAdapter);
+  // Requests may transmit, wait until the adapter is open
+  if (controlPath && !controlStart(controlPath, ampDevice)) {
+    closeAdapter();
     return 1;
   }
-  (logMask & CEC_LOG_DEBUG) && cout << "*** CEC device opened ***" << endl;
 
-  if (logMask & CEC_LOG_DEBUG) {
-    cec_version audioCecVer = CECAdapter->GetDeviceCecVersion(
-        CECDEVICE_AUDIOSYSTEM);
-    cout << "Audio CEC Version 0x" << hex << audioCecVer << endl;
+  if (soakEvents && !soakStart(soakEvents)) {
+    closeAdapter();
+    return 1;
   }
 
+  watchdogNotify("READY=1");
   (logMask & CEC_LOG_DEBUG) && cout << "waiting for ctl-c" << endl;
 
-  // Loop until ctrl-C occurs
-  while (!exit_now) {
-    // :TODO: change to a task suspend
-    // nothing to do.  All happens in the CEC callback on another thread
-    this_thread::sleep_for(chrono::seconds(1));
+  // Loop until ctrl-C occurs or the simulation script or soak ends
+  while (!exit_now && !(simScript && simFinished())
+      && !(soakEvents && soakFinished())) {
+    // All happens in the CEC callback on another thread, just keep the
+    // systemd watchdog fed while the callbacks make progress and save the
+    // state when it changed.  The dispatch thread logs without flushing so
+    // a slow journal never stalls it, its output is flushed from here.
+    this_thread::sleep_for(chrono::milliseconds(watchdogCheck()));
+    stateFileUpdate();
+    cout.flush();
   }
+  watchdogNotify("STOPPING=1");
 
   // Close down and cleanup
   cerr << "Close and cleanup" << endl;
 
-  CECAdapter->Close();
-  UnloadLibCec(CECAdapter);
+  controlStop();
+  soakStop();
+  // Whatever posts to the dispatch thread stops first so the thread still
+  // runs their last events, and libcec stays loaded until it is gone
+  stopAdapter();
+  lircTxStop();
+  dispatchStop();
+  kodiRpcStop();
+  closeAdapter();
+  metricsStop();
+  flightRecClose();
+  stateFileClose();
+  stateClose();
 
-  // :TODO: lirc cleanup
+  if (soakEvents || simScript) {
+    simLircdClose();
+  }
+  xbmc.SendBYE();
 
-  return 0;
+  return soakEvents && !soakPassed() ? 1 : 0;
 }
-
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+
+// Globals shared between the bridge and its helper modules
+extern uint32_t logMask;
+
+// Event handlers, run on the dispatch thread
+void handleKeyPress(const CEC::cec_keypress *key);
+void handleCommand(const CEC::cec_command *command);
+void handleAlert(const CEC::libcec_alert type);
+void handleSourceActivated(const CEC::cec_logical_address logicalAddress,
+    const uint8_t bActivated);
+// Key held back by the gesture recognizer, button is the Kodi button of a
+// recognized gesture or null for the key's usual action.  Runs inside
+// handleKeyPress() or a gesture timer.
+void handleGesture(const CEC::cec_keypress *key, const char *button);
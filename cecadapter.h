@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+
+// The part of ICECAdapter the bridge uses once the adapter is open.  The
+// handlers only talk to this interface so they run unchanged against libcec
+// or the simulated bus (simbus.h); ICECAdapter itself is not implemented
+// as its vtable differs between libcec versions.
+
+class CecAdapter {
+public:
+  virtual ~CecAdapter() {}
+
+  virtual bool Transmit(const CEC::cec_command &command) = 0;
+  virtual bool AudioEnable(bool enable) = 0;
+  virtual bool PowerOnDevices(CEC::cec_logical_address address) = 0;
+  virtual bool StandbyDevices(CEC::cec_logical_address address) = 0;
+  virtual CEC::cec_power_status GetDevicePowerStatus(
+      CEC::cec_logical_address address) = 0;
+  virtual CEC::cec_version GetDeviceCecVersion(
+      CEC::cec_logical_address address) = 0;
+  virtual uint16_t GetDevicePhysicalAddress(
+      CEC::cec_logical_address address) = 0;
+  virtual const char *ToString(const CEC::cec_logical_address address) = 0;
+  virtual const char *ToString(const CEC::cec_power_status status) = 0;
+  virtual void Close() = 0;
+};
+
+class LibCecAdapter : public CecAdapter {
+private:
+  CEC::ICECAdapter *adapter;
+
+public:
+  LibCecAdapter(CEC::ICECAdapter *adapter) : adapter(adapter) {}
+
+  bool Transmit(const CEC::cec_command &command) {
+    return adapter->Transmit(command);
+  }
+  bool AudioEnable(bool enable) {
+    return adapter->AudioEnable(enable);
+  }
+  bool PowerOnDevices(CEC::cec_logical_address address) {
+    return adapter->PowerOnDevices(address);
+  }
+  bool StandbyDevices(CEC::cec_logical_address address) {
+    return adapter->StandbyDevices(address);
+  }
+  CEC::cec_power_status GetDevicePowerStatus(
+      CEC::cec_logical_address address) {
+    return adapter->GetDevicePowerStatus(address);
+  }
+  CEC::cec_version GetDeviceCecVersion(CEC::cec_logical_address address) {
+    return adapter->GetDeviceCecVersion(address);
+  }
+  uint16_t GetDevicePhysicalAddress(CEC::cec_logical_address address) {
+    return adapter->GetDevicePhysicalAddress(address);
+  }
+  const char *ToString(const CEC::cec_logical_address address) {
+    return adapter->ToString(address);
+  }
+  const char *ToString(const CEC::cec_power_status status) {
+    return adapter->ToString(status);
+  }
+  // UnloadLibCec() is left to the caller which owns the loader
+  void Close() {
+    adapter->Close();
+  }
+};
+
+// CEC bit timing (HDMI 1.3a CEC 5.2): a 4.5 ms start bit, then 10 bit
+// blocks (8 data bits, EOM, ACK) for the header, opcode and operands with a
+// nominal 2.4 ms data bit period.
+#define CEC_START_BIT_NS  4500000ull
+#define CEC_BIT_NS        2400000ull
+
+// Time a frame of size bytes (header included) occupies the bus
+static inline uint64_t cecFrameNs(unsigned size) {
+  return CEC_START_BIT_NS + size * 10 * CEC_BIT_NS;
+}
+
+// Bytes on the wire for a command, header and opcode included
+static inline unsigned cecFrameSize(const CEC::cec_command &command) {
+  return 1 + (command.opcode_set ? 1 : 0) + command.parameters.size;
+}
@@ -0,0 +1,464 @@
+#include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloccheck.h"
+#include "cec-lirc.h"
+#include "cecsched.h"
+#include "dispatch.h"
+#include "flightrec.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+// Bus time queries may save up, so a few can go out back to back
+#define QUERY_BURST_NS 250000000ll
+
+enum CecOp {
+  OP_TRANSMIT,
+  OP_AUDIO_ENABLE,
+  OP_POWER_ON,
+  OP_STANDBY,
+  OP_POWER_STATUS,
+  OP_CEC_VERSION
+};
+
+enum RequestState {
+  REQ_FREE,
+  REQ_PENDING,
+  REQ_RUNNING,
+  REQ_DONE        // waiting for the waiters to collect the result
+};
+
+struct CecRequest {
+  RequestState state;
+  CecOp op;
+  CecPriority priority;
+  uint64_t seq;
+  uint64_t queuedNs;
+  cec_logical_address address;
+  bool enable;
+  cec_command command;
+  const char *detail;
+  unsigned waiters;
+  bool exclusive;       // waited for, never merged with another request
+  CecPowerDone done;    // completion still to run on the dispatch thread
+  bool ok;
+  int result;
+};
+
+static const char *priorityName[CEC_PRIO_COUNT] = {
+    "reply", "state", "query" };
+static const char *opName[] = { "Transmit", "AudioEnable", "PowerOnDevices",
+    "StandbyDevices", "GetDevicePowerStatus", "GetDeviceCecVersion" };
+
+static CecRequest queue[CECSCHED_QUEUE];
+static mutex queueLock;
+static condition_variable wake;
+static condition_variable done;
+static uint64_t nextSeq = 0;
+static bool stopping = false;
+static thread worker;
+static CecAdapter *adapter = nullptr;
+static unsigned budgetPct = 100;
+static int64_t queryTokensNs = QUERY_BURST_NS;
+static uint64_t lastRefill = 0;
+
+// Estimated bus time of a request, libcec's own frames included
+static uint64_t busNs(const CecRequest &r) {
+  switch (r.op) {
+  case OP_TRANSMIT:
+    return cecFrameNs(cecFrameSize(r.command));
+  case OP_AUDIO_ENABLE:
+    return cecFrameNs(3);     // <Set System Audio Mode>
+  case OP_POWER_ON:
+    // <Image View On> to the TV, a power key press and release otherwise
+    return r.address == CECDEVICE_TV ? cecFrameNs(2)
+        : cecFrameNs(3) + cecFrameNs(2);
+  case OP_STANDBY:
+    return cecFrameNs(2);
+  case OP_POWER_STATUS:
+  case OP_CEC_VERSION:
+    return cecFrameNs(2) + cecFrameNs(3);   // request and report
+  }
+  return 0;
+}
+
+static bool sameKind(const CecRequest &a, const CecRequest &b) {
+  if (a.op != b.op || a.address != b.address) {
+    return false;
+  }
+  return a.op != OP_TRANSMIT
+      || (a.command.initiator == b.command.initiator
+          && a.command.opcode_set == b.command.opcode_set
+          && a.command.opcode == b.command.opcode);
+}
+
+static bool identical(const CecRequest &a, const CecRequest &b) {
+  switch (a.op) {
+  case OP_TRANSMIT:
+    return a.command.parameters.size == b.command.parameters.size
+        && !memcmp(a.command.parameters.data, b.command.parameters.data,
+            a.command.parameters.size);
+  case OP_AUDIO_ENABLE:
+    return a.enable == b.enable;
+  default:
+    return true;
+  }
+}
+
+// Newest pending request of the same kind, with queries the one already on
+// the bus too as its answer is just as good.  Requests somebody waits for
+// are left alone.
+static CecRequest *findKind(const CecRequest &r) {
+  CecRequest *found = nullptr;
+
+  for (auto &q : queue) {
+    bool live = !q.exclusive && (q.state == REQ_PENDING
+        || (q.state == REQ_RUNNING && q.priority == CEC_PRIO_QUERY));
+    if (live && sameKind(q, r) && (!found || q.seq > found->seq)) {
+      found = &q;
+    }
+  }
+  return found;
+}
+
+// Add a request, or fold it into a pending one.  Returns the entry that
+// carries it, null when the queue is full or stopped.  Called with the
+// lock held.
+static CecRequest *submit(const CecRequest &r) {
+  if (stopping) {
+    return nullptr;
+  }
+  CecRequest *q = r.exclusive ? nullptr : findKind(r);
+
+  // One completion per entry, a second one gets an entry of its own
+  if (q && identical(*q, r) && (!r.done || !q->done || q->done == r.done)) {
+    if (r.done) {
+      q->done = r.done;
+    }
+    if (r.priority < q->priority) {
+      q->priority = r.priority;
+    }
+    metricsCecCoalesced(r.priority);
+    return q;
+  }
+  // A newer state report makes the pending one obsolete, it takes the
+  // place in the queue the newer one would have had
+  if (q && q->state == REQ_PENDING && q->priority == CEC_PRIO_STATE
+      && r.priority == CEC_PRIO_STATE) {
+    q->command = r.command;
+    q->enable = r.enable;
+    q->detail = r.detail;
+    q->seq = nextSeq++;
+    q->queuedNs = metricsNow();
+    metricsCecCoalesced(r.priority);
+    return q;
+  }
+
+  for (auto &e : queue) {
+    if (e.state == REQ_FREE) {
+      e = r;
+      e.state = REQ_PENDING;
+      e.seq = nextSeq++;
+      e.queuedNs = metricsNow();
+      e.waiters = 0;
+      wake.notify_one();
+      return &e;
+    }
+  }
+  cerr << "cecsched: queue full, dropping " << (r.detail ? r.detail : "")
+      << '\n';
+  return nullptr;
+}
+
+static bool post(const CecRequest &r) {
+  lock_guard<mutex> guard(queueLock);
+  return submit(r) != nullptr;
+}
+
+// Queue r and wait for its result, result is -1 when it could not be queued.
+// r gets an entry of its own, a waiter must get what it asked for.
+static int postWait(CecRequest r, bool &ok) {
+  unique_lock<mutex> guard(queueLock);
+  r.exclusive = true;
+  CecRequest *q = submit(r);
+
+  if (!q) {
+    ok = false;
+    return -1;
+  }
+  q->waiters++;
+  done.wait(guard, [q] { return q->state == REQ_DONE; });
+  ok = q->ok;
+  int result = q->result;
+  if (--q->waiters == 0 && !q->done) {
+    q->state = REQ_FREE;
+  }
+  return result;
+}
+
+// Runs an asynchronous query's completion on the dispatch thread
+static void completed(void *arg) {
+  CecRequest *q = (CecRequest *) arg;
+  CecPowerDone fn;
+  cec_logical_address address;
+  cec_power_status power;
+  {
+    lock_guard<mutex> guard(queueLock);
+    fn = q->done;
+    address = q->address;
+    power = q->ok ? cec_power_status(q->result) : CEC_POWER_STATUS_UNKNOWN;
+    q->done = nullptr;
+    if (!q->waiters) {
+      q->state = REQ_FREE;
+    }
+  }
+  fn(address, power);
+}
+
+static void refill(uint64_t now) {
+  if (lastRefill) {
+    queryTokensNs += int64_t(now - lastRefill) * budgetPct / 100;
+    if (queryTokensNs > QUERY_BURST_NS) {
+      queryTokensNs = QUERY_BURST_NS;
+    }
+  }
+  lastRefill = now;
+}
+
+// Oldest request of the most urgent class.  Queries wait while they are
+// over budget, waitNs tells for how long.
+static CecRequest *pick(uint64_t &waitNs) {
+  CecRequest *best = nullptr;
+  bool limited = !stopping && budgetPct < 100 && queryTokensNs < 0;
+
+  waitNs = 0;
+  for (auto &q : queue) {
+    if (q.state != REQ_PENDING) {
+      continue;
+    }
+    if (q.priority == CEC_PRIO_QUERY && limited) {
+      waitNs = uint64_t(-queryTokensNs) * 100 / budgetPct;
+      continue;
+    }
+    if (!best || q.priority < best->priority
+        || (q.priority == best->priority && q.seq < best->seq)) {
+      best = &q;
+    }
+  }
+  return best;
+}
+
+static void execute(CecRequest &r) {
+  char detail[32];
+
+  r.result = 0;
+  switch (r.op) {
+  case OP_TRANSMIT:
+    watchdogStep("Transmit", r.detail);
+    r.ok = adapter->Transmit(r.command);
+    flightRecAction(FR_ACTION_CEC, r.ok, r.detail);
+    if (!r.ok) {
+      cerr << "cecTransmit: " << r.detail << " failed" << endl;
+    }
+    break;
+  case OP_AUDIO_ENABLE:
+    watchdogStep("AudioEnable", r.enable ? "on" : "off");
+    r.ok = adapter->AudioEnable(r.enable);
+    flightRecAction(FR_ACTION_CEC, r.ok,
+        r.enable ? "AudioEnable on" : "AudioEnable off");
+    break;
+  case OP_POWER_ON:
+    watchdogStep("PowerOnDevices");
+    r.ok = adapter->PowerOnDevices(r.address);
+    snprintf(detail, sizeof(detail), "PowerOnDevices %x", r.address);
+    flightRecAction(FR_ACTION_CEC, r.ok, detail);
+    break;
+  case OP_STANDBY:
+    watchdogStep("StandbyDevices");
+    r.ok = adapter->StandbyDevices(r.address);
+    snprintf(detail, sizeof(detail), "StandbyDevices %x", r.address);
+    flightRecAction(FR_ACTION_CEC, r.ok, detail);
+    break;
+  case OP_POWER_STATUS:
+    watchdogStep("GetDevicePowerStatus");
+    r.result = adapter->GetDevicePowerStatus(r.address);
+    r.ok = r.result != CEC_POWER_STATUS_UNKNOWN;
+    break;
+  case OP_CEC_VERSION:
+    watchdogStep("GetDeviceCecVersion");
+    r.result = adapter->GetDeviceCecVersion(r.address);
+    r.ok = r.result != CEC_VERSION_UNKNOWN;
+    break;
+  }
+}
+
+static void transmitLoop() {
+  unique_lock<mutex> guard(queueLock);
+
+  for (;;) {
+    watchdogBeat("cec transmit");
+    uint64_t now = metricsNow();
+    uint64_t waitNs;
+    refill(now);
+    CecRequest *r = pick(waitNs);
+    if (!r) {
+      if (stopping) {
+        break;
+      }
+      // Wake up now and then to beat the watchdog
+      if (!waitNs || waitNs > 500000000) {
+        waitNs = 500000000;
+      }
+      wake.wait_for(guard, chrono::nanoseconds(waitNs));
+      continue;
+    }
+
+    r->state = REQ_RUNNING;
+    uint64_t cost = busNs(*r);
+    if (r->priority == CEC_PRIO_QUERY) {
+      queryTokensNs -= cost;
+    }
+    metricsCecQueued(r->priority, r->queuedNs);
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "cecsched: " << priorityName[r->priority] << " "
+            << (r->detail ? r->detail : opName[r->op]) << " waited "
+            << (now - r->queuedNs) / 1000 << " us" << endl;
+
+    // submit() only attaches waiters to a running request
+    CecRequest run = *r;
+    guard.unlock();
+    {
+      AllocScope scope(ALLOC_CEC_SEND);
+      execute(run);
+      metricsCecTransmit(run.priority, run.ok, cost);
+    }
+    guard.lock();
+
+    r->ok = run.ok;
+    r->result = run.result;
+    if (r->waiters || r->done) {
+      r->state = REQ_DONE;
+      done.notify_all();
+    } else {
+      r->state = REQ_FREE;
+    }
+    // The entry stays taken until the completion ran, a full dispatch ring
+    // drops it like any other event
+    if (r->done && !dispatchCall(completed, r)) {
+      r->done = nullptr;
+      if (!r->waiters) {
+        r->state = REQ_FREE;
+      }
+    }
+  }
+}
+
+bool cecSchedStart(CecAdapter *cecAdapter, unsigned pct) {
+  if (pct == 0 || pct > 100) {
+    cerr << "cecsched: query budget must be 1-100%" << endl;
+    return false;
+  }
+  adapter = cecAdapter;
+  budgetPct = pct;
+  worker = thread(transmitLoop);
+  // Early exits from main() must not destroy a joinable thread
+  atexit(cecSchedStop);
+  return true;
+}
+
+// Sends what is still queued and stops the thread
+void cecSchedStop() {
+  if (!worker.joinable()) {
+    return;
+  }
+  {
+    lock_guard<mutex> guard(queueLock);
+    stopping = true;
+    wake.notify_one();
+  }
+  worker.join();
+}
+
+bool cecQueueTransmit(const cec_command &command, CecPriority priority,
+    const char *detail) {
+  CecRequest r;
+  r.op = OP_TRANSMIT;
+  r.priority = priority;
+  r.address = command.destination;
+  r.enable = false;
+  r.command = command;
+  r.detail = detail;
+  r.exclusive = false;
+  r.done = nullptr;
+  return post(r);
+}
+
+bool cecTransmitWait(const cec_command &command, CecPriority priority,
+    const char *detail) {
+  CecRequest r;
+  bool ok;
+  r.op = OP_TRANSMIT;
+  r.priority = priority;
+  r.address = command.destination;
+  r.enable = false;
+  r.command = command;
+  r.detail = detail;
+  r.exclusive = false;
+  r.done = nullptr;
+  postWait(r, ok);
+  return ok;
+}
+
+static CecRequest stateRequest(CecOp op, cec_logical_address address,
+    bool enable) {
+  CecRequest r;
+  r.op = op;
+  r.priority = op == OP_POWER_STATUS || op == OP_CEC_VERSION
+      ? CEC_PRIO_QUERY : CEC_PRIO_STATE;
+  r.address = address;
+  r.enable = enable;
+  r.command.Clear();
+  r.detail = nullptr;
+  r.exclusive = false;
+  r.done = nullptr;
+  return r;
+}
+
+bool cecQueueAudioEnable(bool enable) {
+  return post(stateRequest(OP_AUDIO_ENABLE, CECDEVICE_AUDIOSYSTEM, enable));
+}
+
+bool cecQueuePowerOn(cec_logical_address address) {
+  return post(stateRequest(OP_POWER_ON, address, false));
+}
+
+bool cecQueueStandby(cec_logical_address address) {
+  return post(stateRequest(OP_STANDBY, address, false));
+}
+
+cec_power_status cecPowerStatus(cec_logical_address address) {
+  bool ok;
+  int result = postWait(stateRequest(OP_POWER_STATUS, address, false), ok);
+  return result < 0 ? CEC_POWER_STATUS_UNKNOWN : cec_power_status(result);
+}
+
+bool cecQueuePowerStatus(cec_logical_address address, CecPowerDone done) {
+  CecRequest r = stateRequest(OP_POWER_STATUS, address, false);
+  r.done = done;
+  return post(r);
+}
+
+cec_version cecVersion(cec_logical_address address) {
+  bool ok;
+  int result = postWait(stateRequest(OP_CEC_VERSION, address, false), ok);
+  return result < 0 ? CEC_VERSION_UNKNOWN : cec_version(result);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+#include "cecadapter.h"
+
+// Outgoing CEC scheduler.  Everything the bridge puts on the bus goes
+// through one transmit thread that picks the oldest request of the most
+// urgent class:
+//
+//   CEC_PRIO_REPLY  answers the other side is waiting for
+//   CEC_PRIO_STATE  audio mode, power on/standby, unsolicited reports
+//   CEC_PRIO_QUERY  power status and version requests
+//
+// Queries are limited to a share of the bus time (--query-budget) so a
+// burst of them cannot crowd out replies.  A request identical to the
+// newest pending one of its kind is coalesced into it, a pending state
+// report to the same destination is superseded by a newer one, which goes
+// to the back of the queue.  Requests with a waiter, such as the control
+// socket's frames, are never coalesced or superseded.  The bus time of
+// every request is estimated from the CEC bit timing and exported as
+// metrics.
+
+enum CecPriority {
+  CEC_PRIO_REPLY,
+  CEC_PRIO_STATE,
+  CEC_PRIO_QUERY,
+  CEC_PRIO_COUNT
+};
+
+#define CECSCHED_QUEUE 32
+
+// budgetPct is the share of bus time queries may use, 100 for no limit
+bool cecSchedStart(CecAdapter *adapter, unsigned budgetPct);
+void cecSchedStop();
+
+// Asynchronous, false when the queue is full.  detail is a static string
+// for the flight recorder.
+bool cecQueueTransmit(const CEC::cec_command &command, CecPriority priority,
+    const char *detail);
+bool cecQueueAudioEnable(bool enable);
+bool cecQueuePowerOn(CEC::cec_logical_address address);
+bool cecQueueStandby(CEC::cec_logical_address address);
+
+// Queue a frame and wait until it was sent, false on a nack or a full queue
+bool cecTransmitWait(const CEC::cec_command &command, CecPriority priority,
+    const char *detail);
+
+// Synchronous queries, CEC_PRIO_QUERY
+CEC::cec_power_status cecPowerStatus(CEC::cec_logical_address address);
+CEC::cec_version cecVersion(CEC::cec_logical_address address);
+
+// Asynchronous power status query for the dispatch thread, which must not
+// wait for the bus.  done runs on the dispatch thread with the answer,
+// CEC_POWER_STATUS_UNKNOWN when the query failed.  False when the queue is
+// full, done is not called then.
+typedef void (*CecPowerDone)(CEC::cec_logical_address address,
+    CEC::cec_power_status power);
+bool cecQueuePowerStatus(CEC::cec_logical_address address, CecPowerDone done);
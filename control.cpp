@@ -0,0 +1,308 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "cec-lirc.h"
+#include "bridgestate.h"
+#include "control.h"
+#include "dispatch.h"
+#include "profiles.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+#define CONTROL_CLIENTS 16
+#define CONTROL_LINE    512
+#define CONTROL_FRAME   16      // header, opcode and 14 operands
+
+struct ControlClient {
+  int fd;
+  size_t len;
+  char buf[CONTROL_LINE];
+};
+
+static int listenFd = -1;
+static int doneFd = -1;
+static const char *socketPath = nullptr;
+static int defaultDevice = -1;
+static ControlClient clients[CONTROL_CLIENTS];
+static atomic<bool> stopServer(false);
+static thread server;
+
+static void runOnDispatch(void *arg) {
+  handleControl((ControlRequest *) arg);
+  uint64_t one = 1;
+  if (write(doneFd, &one, sizeof(one)) < 0) {
+    cerr << "control: eventfd write " << strerror(errno) << endl;
+  }
+}
+
+static bool execute(ControlRequest &request) {
+  if (request.type != CONTROL_IR) {
+    handleControl(&request);
+    return request.ok;
+  }
+  if (!dispatchCall(runOnDispatch, &request)) {
+    return false;
+  }
+  uint64_t count;
+  while (read(doneFd, &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+  return request.ok;
+}
+
+static bool parseFrame(const char *arg, cec_command &command) {
+  uint8_t bytes[CONTROL_FRAME];
+  unsigned n = 0;
+
+  while (*arg && n < sizeof(bytes)) {
+    char *end;
+    unsigned long v = strtoul(arg, &end, 16);
+    if (end == arg || v > 0xff || (*end && *end != ':')) {
+      return false;
+    }
+    bytes[n++] = v;
+    arg = *end ? end + 1 : end;
+  }
+  if (n == 0 || *arg) {
+    return false;
+  }
+  cec_command::Format(command, cec_logical_address(bytes[0] >> 4),
+      cec_logical_address(bytes[0] & 0xf), cec_opcode(n > 1 ? bytes[1] : 0));
+  if (n == 1) {
+    command.opcode_set = 0;   // poll
+  }
+  for (unsigned i = 2; i < n; i++) {
+    command.PushBack(bytes[i]);
+  }
+  return true;
+}
+
+static int formatState(char *out, size_t size) {
+  BridgeState s;
+  if (!stateSnapshot(s)) {
+    return snprintf(out, size, "err state not published\n");
+  }
+
+  int len = snprintf(out, size, "ok amp=%u system-audio=%u active-source=%u "
+      "active-path=%04x volume=%u mute=%u last-key=%02x commands=%llu "
+      "key-presses=%llu ir-sends=%llu ir-failures=%llu kodi-sends=%llu "
+      "kodi-failures=%llu power=", s.ampOn, s.systemAudio, s.activeSource,
+      s.activePath, s.volume, s.mute, s.lastKey,
+      (unsigned long long) s.commands, (unsigned long long) s.keyPresses,
+      (unsigned long long) s.irSends, (unsigned long long) s.irFailures,
+      (unsigned long long) s.kodiSends, (unsigned long long) s.kodiFailures);
+  const char *sep = "";
+  for (unsigned i = 0; i < 16 && len < int(size); i++) {
+    if (s.power[i] != CEC_POWER_STATUS_UNKNOWN) {
+      len += snprintf(out + len, size - len, "%s%x:%02x", sep, i, s.power[i]);
+      sep = ",";
+    }
+  }
+  if (len < int(size)) {
+    len += snprintf(out + len, size - len, "\n");
+  }
+  return len < int(size) ? len : int(size) - 1;
+}
+
+// Handle one request line, returns the length of the reply in out
+static int request(char *line, char *out, size_t size) {
+  ControlRequest req;
+  char *arg = line + strcspn(line, " ");
+
+  if (*arg) {
+    *arg++ = '\0';
+    arg += strspn(arg, " ");
+  }
+  memset(&req, 0, sizeof(req));
+
+  if (!strcmp(line, "ping")) {
+    return snprintf(out, size, "ok\n");
+  }
+  if (!strcmp(line, "state")) {
+    return formatState(out, size);
+  }
+  if (!strcmp(line, "ir") && *arg) {
+    char *key = arg;
+    char *space = strchr(arg, ' ');
+    req.device = defaultDevice;
+    if (space) {
+      *space = '\0';
+      key = space + 1 + strspn(space + 1, " ");
+      req.device = profileFind(arg);
+      if (req.device < 0) {
+        return snprintf(out, size, "err unknown profile %s\n", arg);
+      }
+    }
+    // The IR queue keeps the key name until sent, the profile's copy
+    // outlives it
+    req.keysym = profileKey(req.device, key);
+    if (!req.keysym) {
+      return snprintf(out, size, "err unknown key %s\n", key);
+    }
+    req.type = CONTROL_IR;
+  } else if (!strcmp(line, "cec") && *arg) {
+    req.type = CONTROL_CEC;
+    if (!parseFrame(arg, req.command)) {
+      return snprintf(out, size, "err bad frame %s\n", arg);
+    }
+  } else if ((!strcmp(line, "kodi") || !strcmp(line, "notify")) && *arg) {
+    req.type = line[0] == 'k' ? CONTROL_KODI : CONTROL_NOTIFY;
+    snprintf(req.text, sizeof(req.text), "%s", arg);
+  } else {
+    return snprintf(out, size, "err unknown request %s\n", line);
+  }
+
+  if (!execute(req)) {
+    return snprintf(out, size, "err %s failed\n", line);
+  }
+  return snprintf(out, size, "ok\n");
+}
+
+static void dropClient(ControlClient &c) {
+  close(c.fd);
+  c.fd = -1;
+}
+
+static void readClient(ControlClient &c) {
+  ssize_t n = read(c.fd, c.buf + c.len, sizeof(c.buf) - c.len);
+  if (n <= 0) {
+    dropClient(c);
+    return;
+  }
+  c.len += n;
+
+  char *start = c.buf;
+  char *nl;
+  while ((nl = (char *) memchr(start, '\n', c.buf + c.len - start))) {
+    char reply[CONTROL_LINE];
+    *nl = '\0';
+    if (nl > start && nl[-1] == '\r') {
+      nl[-1] = '\0';
+    }
+    int len = request(start, reply, sizeof(reply));
+    // Replies are short, a client that does not read them is dropped
+    if (send(c.fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+      dropClient(c);
+      return;
+    }
+    start = nl + 1;
+  }
+  c.len -= start - c.buf;
+  memmove(c.buf, start, c.len);
+  if (c.len == sizeof(c.buf)) {
+    cerr << "control: request too long, dropping client" << endl;
+    dropClient(c);
+  }
+}
+
+static void serverLoop() {
+  struct pollfd pfd[1 + CONTROL_CLIENTS];
+
+  while (!stopServer) {
+    watchdogBeat("control server");
+    pfd[0] = { listenFd, POLLIN, 0 };
+    for (int i = 0; i < CONTROL_CLIENTS; i++) {
+      pfd[1 + i] = { clients[i].fd, POLLIN, 0 };
+    }
+    if (poll(pfd, 1 + CONTROL_CLIENTS, 500) <= 0) {
+      continue;
+    }
+
+    for (int i = 0; i < CONTROL_CLIENTS; i++) {
+      if (clients[i].fd >= 0 && pfd[1 + i].revents) {
+        readClient(clients[i]);
+      }
+    }
+    if (pfd[0].revents & POLLIN) {
+      int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        continue;
+      }
+      ControlClient *free = nullptr;
+      for (auto &c : clients) {
+        if (c.fd < 0) {
+          free = &c;
+          break;
+        }
+      }
+      if (!free) {
+        close(fd);
+        continue;
+      }
+      free->fd = fd;
+      free->len = 0;
+    }
+  }
+}
+
+bool controlStart(const char *path, int device) {
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "control: socket path too long " << path << endl;
+    return false;
+  }
+  doneFd = eventfd(0, EFD_CLOEXEC);
+  listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (doneFd < 0 || listenFd < 0) {
+    cerr << "control: " << strerror(errno) << endl;
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  // The socket can put any frame on the bus, keep it to owner and group
+  // from the moment it exists
+  mode_t mask = umask(0117);
+  bool bound = bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(listenFd, 8) < 0) {
+    cerr << "control: failed to listen on " << path << ": "
+        << strerror(errno) << endl;
+    close(listenFd);
+    listenFd = -1;
+    return false;
+  }
+
+  for (auto &c : clients) {
+    c.fd = -1;
+  }
+  socketPath = path;
+  defaultDevice = device;
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "control: listening on " << path << endl;
+
+  server = thread(serverLoop);
+  // Early exits from main() must not destroy a joinable thread
+  atexit(controlStop);
+  return true;
+}
+
+void controlStop() {
+  if (!server.joinable()) {
+    return;
+  }
+  stopServer = true;
+  server.join();
+  for (auto &c : clients) {
+    if (c.fd >= 0) {
+      dropClient(c);
+    }
+  }
+  close(listenFd);
+  listenFd = -1;
+  unlink(socketPath);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "libcec/cec.h"
+
+// Local control socket.  Clients connect to a Unix stream socket and send
+// one request per line, each answered with one line starting with "ok" or
+// "err".  Requests can be pipelined on a connection.
+//
+//   ir [<profile>] <key>      send a key once, default profile is the amp
+//   cec <hex bytes>           transmit a frame, e.g. cec 5f:72:01
+//   kodi <button>             Kodi button press (R1 keymap)
+//   notify <text>             Kodi notification
+//   state                     key=value pairs of the bridge state
+//   ping
+//
+// Requests use the bridge's lircd connection, CEC adapter and Kodi client.
+
+#define CONTROL_KEY_SIZE 128
+
+enum ControlType {
+  CONTROL_IR,
+  CONTROL_CEC,
+  CONTROL_KODI,
+  CONTROL_NOTIFY
+};
+
+struct ControlRequest {
+  ControlType type;
+  int device;                   // CONTROL_IR profile index
+  const char *keysym;           // CONTROL_IR, interned for the IR queue
+  char text[CONTROL_KEY_SIZE];  // CONTROL_KODI button, CONTROL_NOTIFY text
+  CEC::cec_command command;     // CONTROL_CEC
+  bool ok;
+};
+
+// device is the profile index used by "ir" without a profile
+bool controlStart(const char *path, int device);
+void controlStop();
+
+// Executes a request, implemented in cec-lirc.cpp.  CONTROL_IR runs on the
+// dispatch thread, the others on the control thread.
+void handleControl(ControlRequest *request);
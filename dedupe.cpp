@@ -0,0 +1,180 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cec-lirc.h"
+#include "dedupe.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace CEC;
+
+// DEDUPE_RING must be a power of two
+struct DedupeEntry {
+  uint32_t kind;    // initiator and opcode of a command, or the keycode
+  uint64_t hash;    // the whole frame, or press or release
+  uint64_t ns;      // 0 while unused
+};
+
+// What a frame is compared with, keys and commands never match each other
+#define KIND_COMMAND(initiator, opcode) \
+    (0x10000 | (unsigned(initiator) << 8) | unsigned(opcode))
+#define KIND_KEY(keycode) (0x20000 | unsigned(keycode))
+
+static const char *className[DEDUPE_CLASSES] = { "key", "state", "request",
+    "other" };
+
+static DedupeEntry ring[DEDUPE_RING];
+static unsigned ringPos = 0;
+static uint64_t windowNs[DEDUPE_CLASSES] = {
+    DEDUPE_KEY_MS * 1000000ull, DEDUPE_STATE_MS * 1000000ull,
+    DEDUPE_REQUEST_MS * 1000000ull, DEDUPE_OTHER_MS * 1000000ull };
+// Entries older than the longest window need not be looked at
+static uint64_t maxWindowNs = DEDUPE_STATE_MS * 1000000ull;
+
+static DedupeClass classOf(uint8_t opcode) {
+  switch (opcode) {
+  case CEC_OPCODE_USER_CONTROL_PRESSED:
+  case CEC_OPCODE_USER_CONTROL_RELEASE:
+  case CEC_OPCODE_VENDOR_REMOTE_BUTTON_DOWN:
+  case CEC_OPCODE_VENDOR_REMOTE_BUTTON_UP:
+    return DEDUPE_KEY;
+  case CEC_OPCODE_IMAGE_VIEW_ON:
+  case CEC_OPCODE_TEXT_VIEW_ON:
+  case CEC_OPCODE_STANDBY:
+  case CEC_OPCODE_REPORT_POWER_STATUS:
+  case CEC_OPCODE_ACTIVE_SOURCE:
+  case CEC_OPCODE_INACTIVE_SOURCE:
+  case CEC_OPCODE_ROUTING_CHANGE:
+  case CEC_OPCODE_ROUTING_INFORMATION:
+  case CEC_OPCODE_SET_STREAM_PATH:
+  case CEC_OPCODE_REPORT_PHYSICAL_ADDRESS:
+  case CEC_OPCODE_SYSTEM_AUDIO_MODE_REQUEST:
+  case CEC_OPCODE_SET_SYSTEM_AUDIO_MODE:
+  case CEC_OPCODE_SYSTEM_AUDIO_MODE_STATUS:
+  case CEC_OPCODE_REPORT_AUDIO_STATUS:
+    return DEDUPE_STATE;
+  case CEC_OPCODE_GIVE_DEVICE_POWER_STATUS:
+  case CEC_OPCODE_GIVE_AUDIO_STATUS:
+  case CEC_OPCODE_GIVE_SYSTEM_AUDIO_MODE_STATUS:
+  case CEC_OPCODE_GIVE_PHYSICAL_ADDRESS:
+  case CEC_OPCODE_GIVE_OSD_NAME:
+  case CEC_OPCODE_GIVE_DEVICE_VENDOR_ID:
+  case CEC_OPCODE_GET_CEC_VERSION:
+  case CEC_OPCODE_GET_MENU_LANGUAGE:
+  case CEC_OPCODE_REQUEST_ACTIVE_SOURCE:
+  case CEC_OPCODE_REQUEST_SHORT_AUDIO_DESCRIPTORS:
+    return DEDUPE_REQUEST;
+  default:
+    return DEDUPE_OTHER;
+  }
+}
+
+// A release compares with the press before it, so press, release and press
+// again is no duplicate
+static uint8_t kindOpcode(uint8_t opcode) {
+  switch (opcode) {
+  case CEC_OPCODE_USER_CONTROL_RELEASE:
+    return CEC_OPCODE_USER_CONTROL_PRESSED;
+  case CEC_OPCODE_VENDOR_REMOTE_BUTTON_UP:
+    return CEC_OPCODE_VENDOR_REMOTE_BUTTON_DOWN;
+  default:
+    return opcode;
+  }
+}
+
+// FNV-1a, the parameters are at most 14 bytes
+static uint64_t hashFrame(uint8_t opcode, const cec_datapacket &params) {
+  uint64_t h = (0xcbf29ce484222325ull ^ opcode) * 0x100000001b3ull;
+  h = (h ^ params.size) * 0x100000001b3ull;
+  for (uint8_t i = 0; i < params.size; i++) {
+    h = (h ^ params.data[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Newest first, the first entry of the same kind decides
+static bool seen(uint32_t kind, uint64_t hash, uint64_t window,
+    uint64_t now) {
+  for (unsigned i = 1; i <= DEDUPE_RING; i++) {
+    const DedupeEntry &e = ring[(ringPos - i) & (DEDUPE_RING - 1)];
+    if (!e.ns || now - e.ns > maxWindowNs) {
+      return false;
+    }
+    if (e.kind == kind) {
+      return e.hash == hash && now - e.ns <= window;
+    }
+  }
+  return false;
+}
+
+// A dropped frame is not recorded, so a frame repeated for longer than the
+// window still gets through once per window
+static bool duplicate(DedupeClass c, uint32_t kind, uint64_t hash) {
+  uint64_t now = metricsNow();
+  if (windowNs[c] && seen(kind, hash, windowNs[c], now)) {
+    metricsDuplicate(c);
+    return true;
+  }
+  ring[ringPos++ & (DEDUPE_RING - 1)] = { kind, hash, now };
+  return false;
+}
+
+void dedupeWindow(DedupeClass c, unsigned ms) {
+  windowNs[c] = ms * 1000000ull;
+  maxWindowNs = 0;
+  for (auto w : windowNs) {
+    maxWindowNs = max(maxWindowNs, w);
+  }
+}
+
+bool dedupeParse(const char *arg) {
+  const char *eq = strchr(arg, '=');
+  char *end;
+
+  if (!eq) {
+    return false;
+  }
+  unsigned long ms = strtoul(eq + 1, &end, 10);
+  if (!eq[1] || *end || ms > 60000) {
+    return false;
+  }
+  size_t len = eq - arg;
+  if (len == 3 && strncmp(arg, "all", 3) == 0) {
+    for (int c = 0; c < DEDUPE_CLASSES; c++) {
+      dedupeWindow(DedupeClass(c), ms);
+    }
+    return true;
+  }
+  for (int c = 0; c < DEDUPE_CLASSES; c++) {
+    if (strlen(className[c]) == len && strncmp(arg, className[c], len) == 0) {
+      dedupeWindow(DedupeClass(c), ms);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool dedupeKeyPress(const cec_keypress *key) {
+  // A press compares with the key's last press or release
+  if (!duplicate(DEDUPE_KEY, KIND_KEY(key->keycode), key->duration != 0)) {
+    return false;
+  }
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "dedupe: dropped key " << hex << unsigned(key->keycode)
+          << (key->duration ? " release" : " press") << dec << '\n';
+  return true;
+}
+
+bool dedupeCommand(const cec_command *command) {
+  if (!duplicate(classOf(command->opcode),
+      KIND_COMMAND(command->initiator, kindOpcode(command->opcode)),
+      hashFrame(command->opcode, command->parameters))) {
+    return false;
+  }
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "dedupe: dropped opcode " << hex
+          << unsigned(command->opcode) << " from "
+          << unsigned(command->initiator) << dec << '\n';
+  return true;
+}
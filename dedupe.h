@@ -0,0 +1,41 @@
+#pragma once
+
+#include "libcec/cec.h"
+
+// Inbound duplicate frame suppression in front of the key press and command
+// handlers.  TVs resend frames whose ack they missed and some send a report
+// twice, which toggled mute back or ran turnAudioOn() again.  A frame equal
+// to the previous one of the same initiator and opcode within its class's
+// window is dropped.  For keys the previous frame is the last press or
+// release, so a second press after a release always gets through.  Recent
+// frames are kept as hashes in a fixed ring, so a check costs a short hash
+// and a scan of the ring and allocates nothing.
+// Dropped frames are counted in cec_lirc_duplicates_total.
+//
+// Only to be used from the dispatch thread.
+
+#define DEDUPE_RING 32
+
+enum DedupeClass {
+  DEDUPE_KEY,       // key presses, <User Control Pressed> and friends
+  DEDUPE_STATE,     // power, routing and system audio announcements
+  DEDUPE_REQUEST,   // <Give ...> and other requests expecting a reply
+  DEDUPE_OTHER,
+  DEDUPE_CLASSES
+};
+
+// Default windows.  A repeated request may mean our reply got lost, so
+// requests are always answered unless configured otherwise.
+#define DEDUPE_KEY_MS     200
+#define DEDUPE_STATE_MS   500
+#define DEDUPE_REQUEST_MS 0
+#define DEDUPE_OTHER_MS   100
+
+// Sets the window of a class, 0 lets every frame of the class through
+void dedupeWindow(DedupeClass c, unsigned ms);
+// Parses CLASS=MS (key, state, request, other or all), false if invalid
+bool dedupeParse(const char *arg);
+
+// True when the frame is a duplicate and is to be dropped
+bool dedupeKeyPress(const CEC::cec_keypress *key);
+bool dedupeCommand(const CEC::cec_command *command);
@@ -0,0 +1,324 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "alloccheck.h"
+#include "cec-lirc.h"
+#include "dispatch.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+#define DISPATCH_RING   256   // power of two
+#define DISPATCH_TIMERS 32
+#define PREFAULT_STACK  (64 * 1024)
+
+enum DispatchType {
+  EV_KEYPRESS,
+  EV_COMMAND,
+  EV_ALERT,
+  EV_SOURCE,
+  EV_CALL
+};
+
+static const AllocEvent allocEvent[] = { ALLOC_KEYPRESS, ALLOC_COMMAND,
+    ALLOC_ALERT, ALLOC_SOURCE, ALLOC_CALL };
+
+// Bounded MPSC ring, each slot carries a sequence number telling producers
+// and the consumer whose turn it is (Vyukov)
+struct DispatchSlot {
+  atomic<uint32_t> seq;
+  DispatchType type;
+  cec_keypress key;
+  cec_command command;
+  libcec_alert alert;
+  cec_logical_address logicalAddress;
+  uint8_t activated;
+  DispatchTimerFn fn;
+  void *arg;
+};
+
+struct DispatchTimer {
+  uint64_t deadline;    // 0 when the slot is free
+  DispatchTimerFn fn;
+  void *arg;
+};
+
+static DispatchSlot ring[DISPATCH_RING];
+static atomic<uint32_t> enqueuePos(0);
+static uint32_t dequeuePos = 0;
+static DispatchTimer timers[DISPATCH_TIMERS];
+static int wakeFd = -1;
+static atomic<bool> stopDispatch(false);
+static thread dispatcher;
+
+static DispatchSlot *claim() {
+  uint32_t pos = enqueuePos.load(memory_order_relaxed);
+
+  // Nobody would run it, and wakeFd is about to be closed
+  if (stopDispatch) {
+    return nullptr;
+  }
+
+  for (;;) {
+    DispatchSlot *slot = &ring[pos & (DISPATCH_RING - 1)];
+    int32_t diff = int32_t(slot->seq.load(memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+          memory_order_relaxed)) {
+        return slot;
+      }
+    } else if (diff < 0) {
+      return nullptr;   // full
+    } else {
+      pos = enqueuePos.load(memory_order_relaxed);
+    }
+  }
+}
+
+static bool publish(DispatchSlot *slot) {
+  uint32_t pos = slot->seq.load(memory_order_relaxed);
+  slot->seq.store(pos + 1, memory_order_release);
+
+  uint64_t one = 1;
+  if (!stopDispatch && write(wakeFd, &one, sizeof(one)) < 0
+      && errno != EAGAIN) {
+    cerr << "dispatch: eventfd write " << strerror(errno) << '\n';
+  }
+  return true;
+}
+
+static bool full(const char *what) {
+  if (!stopDispatch) {
+    cerr << "dispatch: queue full, dropping " << what << '\n';
+  }
+  return false;
+}
+
+bool dispatchKeyPress(const cec_keypress *key) {
+  DispatchSlot *slot = claim();
+  if (!slot) {
+    return full("key press");
+  }
+  slot->type = EV_KEYPRESS;
+  slot->key = *key;
+  return publish(slot);
+}
+
+bool dispatchCommand(const cec_command *command) {
+  DispatchSlot *slot = claim();
+  if (!slot) {
+    return full("command");
+  }
+  slot->type = EV_COMMAND;
+  slot->command = *command;
+  return publish(slot);
+}
+
+bool dispatchAlert(libcec_alert type) {
+  DispatchSlot *slot = claim();
+  if (!slot) {
+    return full("alert");
+  }
+  slot->type = EV_ALERT;
+  slot->alert = type;
+  return publish(slot);
+}
+
+bool dispatchSource(cec_logical_address logicalAddress, uint8_t activated) {
+  DispatchSlot *slot = claim();
+  if (!slot) {
+    return full("source activation");
+  }
+  slot->type = EV_SOURCE;
+  slot->logicalAddress = logicalAddress;
+  slot->activated = activated;
+  return publish(slot);
+}
+
+bool dispatchCall(DispatchTimerFn fn, void *arg) {
+  DispatchSlot *slot = claim();
+  if (!slot) {
+    return full("call");
+  }
+  slot->type = EV_CALL;
+  slot->fn = fn;
+  slot->arg = arg;
+  return publish(slot);
+}
+
+int dispatchTimer(uint64_t delayNs, DispatchTimerFn fn, void *arg) {
+  for (int i = 0; i < DISPATCH_TIMERS; i++) {
+    if (!timers[i].deadline) {
+      timers[i].deadline = metricsNow() + delayNs;
+      timers[i].fn = fn;
+      timers[i].arg = arg;
+      return i;
+    }
+  }
+  cerr << "dispatch: out of timers" << '\n';
+  return -1;
+}
+
+void dispatchCancel(int id) {
+  if (id >= 0 && id < DISPATCH_TIMERS) {
+    timers[id].deadline = 0;
+  }
+}
+
+// Runs due timers, returns the poll timeout until the next one in ms.
+// Timers falling due while another one runs wait for the next round, so
+// the events that came in meanwhile are handled first.
+static int runTimers() {
+  uint64_t due = metricsNow();
+  uint64_t now = due;
+  uint64_t next = 0;
+
+  for (auto &t : timers) {
+    if (!t.deadline) {
+      continue;
+    }
+    if (t.deadline <= due) {
+      AllocScope scope(ALLOC_TIMER);
+      t.deadline = 0;
+      t.fn(t.arg);
+      now = metricsNow();
+    } else if (!next || t.deadline < next) {
+      next = t.deadline;
+    }
+  }
+  if (next && next <= now) {
+    return 0;
+  }
+  // Wake up at least twice a second to feed the watchdog
+  if (!next || next - now > 500000000ull) {
+    return 500;
+  }
+  // Round up so we never spin on a timer a fraction of a ms away
+  return int((next - now + 999999) / 1000000);
+}
+
+static void drain() {
+  for (;;) {
+    DispatchSlot *slot = &ring[dequeuePos & (DISPATCH_RING - 1)];
+    if (slot->seq.load(memory_order_acquire) != dequeuePos + 1) {
+      return;
+    }
+
+    AllocScope scope(allocEvent[slot->type]);
+    switch (slot->type) {
+    case EV_KEYPRESS:
+      handleKeyPress(&slot->key);
+      break;
+    case EV_COMMAND:
+      handleCommand(&slot->command);
+      break;
+    case EV_ALERT:
+      handleAlert(slot->alert);
+      break;
+    case EV_SOURCE:
+      handleSourceActivated(slot->logicalAddress, slot->activated);
+      break;
+    case EV_CALL:
+      slot->fn(slot->arg);
+      break;
+    }
+
+    slot->seq.store(dequeuePos + DISPATCH_RING, memory_order_release);
+    dequeuePos++;
+  }
+}
+
+// Touch the stack the handlers will use so the first event does not take
+// page faults, mlockall() then keeps it resident
+static void __attribute__((noinline)) prefaultStack() {
+  volatile char stack[PREFAULT_STACK];
+  for (size_t i = 0; i < sizeof(stack); i += 4096) {
+    stack[i] = 0;
+  }
+}
+
+static void configureThread(const DispatchOptions &options) {
+  if (options.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(options.cpu, &cpus);
+    int r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (r) {
+      cerr << "dispatch: cannot pin to cpu " << options.cpu << ": "
+          << strerror(r) << endl;
+    }
+  }
+  if (options.rtPriority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = options.rtPriority;
+    int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (r) {
+      cerr << "dispatch: cannot set SCHED_FIFO priority "
+          << options.rtPriority << ": " << strerror(r) << endl;
+    }
+  }
+}
+
+static void dispatchLoop(DispatchOptions options) {
+  struct pollfd pfd = { wakeFd, POLLIN, 0 };
+
+  configureThread(options);
+  prefaultStack();
+
+  while (!stopDispatch) {
+    watchdogBeat("dispatch");
+    int timeout = runTimers();
+    if (poll(&pfd, 1, timeout) > 0) {
+      uint64_t count;
+      if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        cerr << "dispatch: eventfd read " << strerror(errno) << '\n';
+      }
+    }
+    drain();
+  }
+}
+
+bool dispatchStart(const DispatchOptions &options) {
+  for (uint32_t i = 0; i < DISPATCH_RING; i++) {
+    ring[i].seq.store(i, memory_order_relaxed);
+  }
+  wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeFd < 0) {
+    cerr << "dispatch: eventfd " << strerror(errno) << endl;
+    return false;
+  }
+  dispatcher = thread(dispatchLoop, options);
+  // Early exits from main() must not destroy a joinable thread
+  atexit(dispatchStop);
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "dispatch: started, priority " << options.rtPriority
+          << " cpu " << options.cpu << endl;
+  return true;
+}
+
+void dispatchStop() {
+  if (!dispatcher.joinable()) {
+    return;
+  }
+  stopDispatch = true;
+  uint64_t one = 1;
+  if (write(wakeFd, &one, sizeof(one)) < 0) {
+    // the loop still wakes up on its poll timeout
+  }
+  dispatcher.join();
+  close(wakeFd);
+  wakeFd = -1;
+}
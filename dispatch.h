@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+
+// IR/Kodi dispatch thread.  The libcec callbacks copy their arguments into
+// a preallocated lock-free ring and return; the dispatch thread runs the
+// handlers (handleKeyPress() etc. in cec-lirc.cpp) and one shot timers.
+// The thread can run under SCHED_FIFO pinned to a core and allocates
+// nothing once started.
+
+struct DispatchOptions {
+  int rtPriority;   // SCHED_FIFO priority, 0 keeps SCHED_OTHER
+  int cpu;          // core to pin the thread to, -1 for any
+};
+
+bool dispatchStart(const DispatchOptions &options);
+void dispatchStop();
+
+// Called from the libcec callback threads, false if the ring is full
+bool dispatchKeyPress(const CEC::cec_keypress *key);
+bool dispatchCommand(const CEC::cec_command *command);
+bool dispatchAlert(CEC::libcec_alert type);
+bool dispatchSource(CEC::cec_logical_address logicalAddress, uint8_t activated);
+
+typedef void (*DispatchTimerFn)(void *arg);
+
+// Run fn(arg) on the dispatch thread, from any other thread
+bool dispatchCall(DispatchTimerFn fn, void *arg);
+
+// One shot timers, only to be used from the dispatch thread.  Returns a
+// timer id or -1 when all timer slots are in use.
+int dispatchTimer(uint64_t delayNs, DispatchTimerFn fn, void *arg);
+void dispatchCancel(int id);
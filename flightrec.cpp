@@ -0,0 +1,170 @@
+#include <iostream>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flightrec.h"
+
+using namespace std;
+
+static FlightHeader *header = nullptr;
+static FlightRecord *records = nullptr;
+static size_t mapSize = 0;
+
+static FlightRecord *claim(uint8_t type, uint64_t &seq) {
+  FlightHeader *hdr = __atomic_load_n(&header, __ATOMIC_ACQUIRE);
+  if (!hdr) {
+    return nullptr;
+  }
+  seq = __atomic_add_fetch(&hdr->head, 1, __ATOMIC_RELAXED);
+  FlightRecord *rec = &records[(seq - 1) % hdr->capacity];
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->timeNs = uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  rec->type = type;
+  rec->a = rec->b = rec->c = 0;
+  rec->len = 0;
+  rec->ok = 1;
+  rec->reserved = 0;
+  rec->value = 0;
+  return rec;
+}
+
+static void commit(FlightRecord *rec, uint64_t seq) {
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+bool flightRecOpen(const char *path, uint32_t capacity) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    cerr << "flightRecOpen: " << path << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  mapSize = sizeof(FlightHeader) + size_t(capacity) * sizeof(FlightRecord);
+
+  // Keep the history of a previous run if the layout matches
+  struct stat st;
+  bool reuse = false;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) == mapSize) {
+    FlightHeader old;
+    if (pread(fd, &old, sizeof(old), 0) == sizeof(old)
+        && memcmp(old.magic, FLIGHTREC_MAGIC, sizeof(old.magic)) == 0
+        && old.recordSize == sizeof(FlightRecord)
+        && old.capacity == capacity) {
+      reuse = true;
+    }
+  }
+  if (!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, mapSize) < 0)) {
+    cerr << "flightRecOpen: ftruncate " << strerror(errno) << endl;
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+      0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    cerr << "flightRecOpen: mmap " << strerror(errno) << endl;
+    return false;
+  }
+
+  FlightHeader *hdr = (FlightHeader *) map;
+  if (!reuse) {
+    memcpy(hdr->magic, FLIGHTREC_MAGIC, sizeof(hdr->magic));
+    hdr->recordSize = sizeof(FlightRecord);
+    hdr->capacity = capacity;
+    hdr->head = 0;
+  }
+  records = (FlightRecord *) (hdr + 1);
+  __atomic_store_n(&header, hdr, __ATOMIC_RELEASE);
+
+  uint64_t seq;
+  FlightRecord *rec = claim(FR_START, seq);
+  rec->value = getpid();
+  commit(rec, seq);
+  return true;
+}
+
+void flightRecClose() {
+  FlightHeader *hdr = __atomic_exchange_n(&header, nullptr, __ATOMIC_ACQ_REL);
+  if (hdr) {
+    msync(hdr, mapSize, MS_ASYNC);
+    munmap(hdr, mapSize);
+  }
+}
+
+void flightRecCommand(uint8_t initiator, uint8_t destination, uint8_t opcode,
+    const uint8_t *params, uint8_t len) {
+  uint64_t seq;
+  FlightRecord *rec = claim(FR_COMMAND, seq);
+  if (!rec) {
+    return;
+  }
+  rec->a = initiator;
+  rec->b = destination;
+  rec->c = opcode;
+  rec->len = len < sizeof(rec->data) ? len : sizeof(rec->data);
+  memcpy(rec->data, params, rec->len);
+  commit(rec, seq);
+}
+
+void flightRecKeyPress(uint8_t keycode, uint32_t duration) {
+  uint64_t seq;
+  FlightRecord *rec = claim(FR_KEYPRESS, seq);
+  if (!rec) {
+    return;
+  }
+  rec->a = keycode;
+  rec->value = duration;
+  commit(rec, seq);
+}
+
+void flightRecAlert(uint32_t type) {
+  uint64_t seq;
+  FlightRecord *rec = claim(FR_ALERT, seq);
+  if (!rec) {
+    return;
+  }
+  rec->value = type;
+  commit(rec, seq);
+}
+
+void flightRecSource(uint8_t logicalAddress, uint8_t activated) {
+  uint64_t seq;
+  FlightRecord *rec = claim(FR_SOURCE, seq);
+  if (!rec) {
+    return;
+  }
+  rec->a = logicalAddress;
+  rec->b = activated;
+  commit(rec, seq);
+}
+
+void flightRecAction(FlightAction action, bool ok, const char *detail) {
+  uint64_t seq;
+  FlightRecord *rec = claim(FR_ACTION, seq);
+  if (!rec) {
+    return;
+  }
+  rec->a = action;
+  rec->ok = ok;
+  if (detail) {
+    size_t len = strnlen(detail, sizeof(rec->data));
+    // lircd packets are newline terminated
+    while (len > 0 && detail[len - 1] == '\n') {
+      len--;
+    }
+    memcpy(rec->data, detail, len);
+    rec->len = len;
+  }
+  commit(rec, seq);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+// Always-on flight recorder.  Every CEC command, key press, alert and bridge
+// action is written as a fixed-size record into a circular mmap'd file so
+// the history survives a crash of the process.  The file is decoded with
+// cec-flightrec.
+//
+// A slot is claimed with an atomic add on the header head counter.  The
+// record seq is cleared, the body filled in and seq stored last so a reader
+// can drop records torn by a crash or a concurrent write.
+
+#define FLIGHTREC_MAGIC   "CECFLTR1"
+#define FLIGHTREC_PATH    "/var/tmp/cec-lirc.flight"
+#define FLIGHTREC_RECORDS 8192
+
+enum FlightRecType {
+  FR_START = 1,   // recorder opened, value is the pid
+  FR_COMMAND,     // a=initiator b=destination c=opcode data=parameters
+  FR_KEYPRESS,    // a=keycode value=duration
+  FR_ALERT,       // value=libcec_alert
+  FR_SOURCE,      // a=logical address b=activated
+  FR_ACTION       // a=FlightAction ok=result data=detail text
+};
+
+enum FlightAction {
+  FR_ACTION_IR = 1,
+  FR_ACTION_KODI,
+  FR_ACTION_CEC,
+  FR_ACTION_AUDIO_ON,
+  FR_ACTION_AUDIO_OFF,
+  FR_ACTION_WARM_UP
+};
+
+struct FlightHeader {
+  char     magic[8];
+  uint32_t recordSize;
+  uint32_t capacity;
+  uint64_t head;        // next sequence number to be written
+  uint8_t  reserved[40];
+};
+
+struct FlightRecord {
+  uint64_t seq;         // 1 based, 0 while the slot is being written
+  uint64_t timeNs;      // CLOCK_REALTIME
+  uint8_t  type;
+  uint8_t  a;
+  uint8_t  b;
+  uint8_t  c;
+  uint8_t  len;         // bytes used in data
+  uint8_t  ok;
+  uint16_t reserved;
+  uint32_t value;
+  uint8_t  data[100];
+};
+
+static_assert(sizeof(FlightHeader) == 64, "FlightHeader layout");
+static_assert(sizeof(FlightRecord) == 128, "FlightRecord layout");
+
+bool flightRecOpen(const char *path, uint32_t records = FLIGHTREC_RECORDS);
+void flightRecClose();
+
+void flightRecCommand(uint8_t initiator, uint8_t destination, uint8_t opcode,
+    const uint8_t *params, uint8_t len);
+void flightRecKeyPress(uint8_t keycode, uint32_t duration);
+void flightRecAlert(uint32_t type);
+void flightRecSource(uint8_t logicalAddress, uint8_t activated);
+void flightRecAction(FlightAction action, bool ok, const char *detail);
@@ -0,0 +1,176 @@
+#include <iostream>
+
+#include "cec-lirc.h"
+#include "dispatch.h"
+#include "gesture.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+enum GestureType { GESTURE_LONG, GESTURE_DOUBLE };
+
+struct GestureBinding {
+  cec_user_control_code keycode;
+  GestureType type;
+  const char *button;       // Kodi button (R1 keymap) the gesture sends
+};
+
+// The short press keeps the key's usual action
+static const GestureBinding bindings[] = {
+  { CEC_USER_CONTROL_CODE_F1_BLUE, GESTURE_LONG, "contentsmenu" },
+  { CEC_USER_CONTROL_CODE_F2_RED, GESTURE_LONG, "rootmenu" },
+  { CEC_USER_CONTROL_CODE_F3_GREEN, GESTURE_LONG, "playlist" },
+  { CEC_USER_CONTROL_CODE_F4_YELLOW, GESTURE_LONG, "subtitle" },
+  { CEC_USER_CONTROL_CODE_SELECT, GESTURE_DOUBLE, "pause" },
+};
+
+#define BINDINGS (sizeof(bindings) / sizeof(bindings[0]))
+
+struct GestureState {
+  const GestureBinding *binding;
+  cec_keypress press;       // the press held back
+  cec_keypress release;     // its release once seen
+  uint64_t pressNs;
+  int timer;
+  bool held;                // between press and release
+  bool pending;             // press held back, nothing sent yet
+  bool released;            // the release came while pending
+  bool sentDown;            // the plain press went out, release to follow
+};
+
+static GestureState states[BINDINGS];
+static uint64_t longNs = 0;
+static uint64_t doubleNs = 0;
+
+// The key's usual action for the held back press, and for its release when
+// that came already
+static void sendPlain(GestureState &s, MetricsGesture gesture) {
+  metricsGesture(gesture, s.pressNs);
+  s.pending = false;
+  handleGesture(&s.press, nullptr);
+  if (s.released) {
+    handleGesture(&s.release, nullptr);
+  } else {
+    s.sentDown = true;
+  }
+}
+
+static void sendGesture(GestureState &s, MetricsGesture gesture) {
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "gesture: key " << hex << unsigned(s.press.keycode) << dec
+          << (gesture == METRICS_GESTURE_LONG ? " long" : " double")
+          << " press, " << s.binding->button << '\n';
+  metricsGesture(gesture, s.pressNs);
+  s.pending = false;
+  handleGesture(&s.press, s.binding->button);
+}
+
+static void timerFired(void *arg) {
+  WatchdogScope scope("gesture");
+  GestureState &s = *(GestureState *) arg;
+  s.timer = -1;
+  if (!s.pending) {
+    return;
+  }
+  if (s.binding->type == GESTURE_LONG) {
+    sendGesture(s, METRICS_GESTURE_LONG);
+  } else {
+    // No second press came
+    sendPlain(s, METRICS_GESTURE_SINGLE);
+  }
+}
+
+static void cancelTimer(GestureState &s) {
+  if (s.timer >= 0) {
+    dispatchCancel(s.timer);
+    s.timer = -1;
+  }
+}
+
+static void pressed(GestureState &s, const cec_keypress *key) {
+  if (s.held) {
+    // Repeated press of a held key
+    return;
+  }
+  if (s.pending && s.binding->type == GESTURE_DOUBLE) {
+    cancelTimer(s);
+    s.held = true;
+    sendGesture(s, METRICS_GESTURE_DOUBLE);
+    return;
+  }
+
+  s.press = *key;
+  s.pressNs = metricsNow();
+  s.held = true;
+  s.pending = true;
+  s.released = false;
+  s.sentDown = false;
+  s.timer = dispatchTimer(s.binding->type == GESTURE_LONG ? longNs : doubleNs,
+      timerFired, &s);
+  if (s.timer < 0) {
+    sendPlain(s, METRICS_GESTURE_SHORT);
+  }
+}
+
+static void released(GestureState &s, const cec_keypress *key) {
+  if (!s.held) {
+    // A release without its press, the hold time tells
+    s.press = *key;
+    s.press.duration = 0;
+    s.release = *key;
+    s.pressNs = metricsNow();
+    s.released = true;
+    if (s.binding->type == GESTURE_LONG && key->duration * 1000000ull
+        >= longNs) {
+      sendGesture(s, METRICS_GESTURE_LONG);
+    } else {
+      sendPlain(s, METRICS_GESTURE_SHORT);
+    }
+    return;
+  }
+
+  s.held = false;
+  if (s.sentDown) {
+    s.sentDown = false;
+    handleGesture(key, nullptr);
+  } else if (s.pending) {
+    s.release = *key;
+    s.released = true;
+    // A long press key released in time is a short press, a select waits
+    // for the second press
+    if (s.binding->type == GESTURE_LONG) {
+      cancelTimer(s);
+      sendPlain(s, METRICS_GESTURE_SHORT);
+    }
+  }
+  // else the gesture was sent, the release goes with it
+}
+
+void gestureInit(unsigned longMs, unsigned doubleMs) {
+  longNs = uint64_t(longMs) * 1000000;
+  doubleNs = uint64_t(doubleMs) * 1000000;
+  for (unsigned i = 0; i < BINDINGS; i++) {
+    states[i].binding = &bindings[i];
+    states[i].timer = -1;
+  }
+}
+
+bool gestureKey(const cec_keypress *key) {
+  for (auto &s : states) {
+    if (!s.binding || s.binding->keycode != key->keycode) {
+      continue;
+    }
+    if (!(s.binding->type == GESTURE_LONG ? longNs : doubleNs)) {
+      return false;
+    }
+    if (key->duration == 0) {
+      pressed(s, key);
+    } else {
+      released(s, key);
+    }
+    return true;
+  }
+  return false;
+}
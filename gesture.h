@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+
+// Long and double press recognition on CEC keys.  libcec reports a key as
+// a press (duration 0) and a release with the hold time.  Keys with a
+// gesture bound are held back until the release, a dispatch timer or the
+// next press decides: a coloured key held for the long press time sends
+// its second Kodi button, a second select within the double press time
+// sends "pause".  Every other key is handled at once, so plain presses
+// get no extra latency.  The decision delays are in the metrics
+// (cec_lirc_gesture_delay_seconds).
+//
+// Only to be used from the dispatch thread.
+
+#define GESTURE_LONG_MS   500
+#define GESTURE_DOUBLE_MS 300
+
+// 0 disables the gesture
+void gestureInit(unsigned longMs, unsigned doubleMs);
+
+// Returns false when no gesture is bound to the key and the caller is to
+// handle it.  Otherwise the key ends up in handleGesture().
+bool gestureKey(const CEC::cec_keypress *key);
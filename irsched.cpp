@@ -0,0 +1,151 @@
+#include <iostream>
+
+#include "cec-lirc.h"
+#include "dispatch.h"
+#include "irsched.h"
+#include "lirctx.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace CEC;
+
+struct IrPending {
+  const char *keysym;   // points into a profile or rule, both outlive us
+  IrSendType type;
+  unsigned count;
+};
+
+struct IrDevice {
+  IrPending queue[IRSCHED_QUEUE];
+  unsigned head;
+  unsigned count;
+  uint64_t nextFree;    // earliest start of the next frame
+  int timer;            // armed dispatch timer or -1
+  unsigned sending;     // queued on the transmitter, not done yet
+};
+
+static IrDevice devices[PROFILES_MAX] = {};
+static bool initialised = false;
+
+static void pump(int device);
+
+static void timerFired(void *arg) {
+  IrDevice *d = (IrDevice *) arg;
+  d->timer = -1;
+  pump(d - devices);
+}
+
+// The gap (or settle time) counts from the end of the frame
+static void sent(int device, const char *keysym, IrSendType type, bool ok) {
+  const IrProfile &profile = profileGet(device);
+  IrDevice &d = devices[device];
+
+  uint64_t hold = uint64_t(profile.gapMs) * 1000000;
+  if (type != IR_SEND_STOP && profile.keys[IR_POWER_ON] == keysym
+      && profile.settleMs > profile.gapMs) {
+    hold = uint64_t(profile.settleMs) * 1000000;
+  }
+  d.nextFree = max(d.nextFree, metricsNow() + hold);
+  d.sending--;
+  if (d.timer < 0) {
+    pump(device);
+  }
+}
+
+static void transmit(int device, const IrPending &p) {
+  if (!lircTxSend(device, p.keysym, p.type, p.count, sent)) {
+    cerr << "irSend: transmitter busy for " << profileGet(device).name
+        << ", dropping " << p.keysym << '\n';
+    return;
+  }
+  devices[device].sending++;
+}
+
+static void pump(int device) {
+  IrDevice &d = devices[device];
+
+  while (d.count) {
+    const IrPending &p = d.queue[d.head];
+    uint64_t now = metricsNow();
+    if (p.type != IR_SEND_STOP && d.sending) {
+      // sent() pumps again
+      return;
+    }
+    if (p.type != IR_SEND_STOP && now < d.nextFree) {
+      (logMask & CEC_LOG_DEBUG)
+          && cout << "irSend: " << p.keysym << " held "
+              << (d.nextFree - now) / 1000000 << " ms" << '\n';
+      d.timer = dispatchTimer(d.nextFree - now, timerFired, &d);
+      if (d.timer < 0) {
+        // Retried on the next irSend() for this device
+        cerr << "irSend: no timer for " << profileGet(device).name << '\n';
+      }
+      return;
+    }
+    IrPending next = p;
+    d.head = (d.head + 1) % IRSCHED_QUEUE;
+    d.count--;
+    transmit(device, next);
+  }
+}
+
+bool irSend(int device, const char *keysym, IrSendType type) {
+  if (!initialised) {
+    for (auto &d : devices) {
+      d.timer = -1;
+    }
+    initialised = true;
+  }
+  if (device < 0 || unsigned(device) >= profileCount() || !keysym
+      || !keysym[0]) {
+    return false;
+  }
+
+  IrDevice &d = devices[device];
+  if (d.count == IRSCHED_QUEUE) {
+    cerr << "irSend: queue full for " << profileGet(device).name
+        << ", dropping " << keysym << '\n';
+    return false;
+  }
+  d.queue[(d.head + d.count) % IRSCHED_QUEUE] = { keysym, type, 1 };
+  d.count++;
+  // An armed timer pumps the queue when the device is free again
+  if (d.timer < 0) {
+    pump(device);
+  }
+  return true;
+}
+
+bool irSendKey(int device, IrKey key, IrSendType type) {
+  if (device < 0 || unsigned(device) >= profileCount()) {
+    return false;
+  }
+  const string &keysym = profileGet(device).keys[key];
+  if (keysym.empty()) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "irSendKey: " << profileGet(device).name << " has no key "
+            << key << '\n';
+    return false;
+  }
+  return irSend(device, keysym.c_str(), type);
+}
+
+bool irSendBatch(int device, IrKey key) {
+  if (device < 0 || unsigned(device) >= profileCount()) {
+    return false;
+  }
+  const string &keysym = profileGet(device).keys[key];
+  IrDevice &d = devices[device];
+  // Only the last queued key, the order of different keys stays
+  if (d.count) {
+    IrPending &last = d.queue[(d.head + d.count - 1) % IRSCHED_QUEUE];
+    if (last.type == IR_SEND_ONCE && last.keysym == keysym
+        && last.count < IRSCHED_MAX_COUNT) {
+      last.count++;
+      (logMask & CEC_LOG_DEBUG)
+          && cout << "irSend: " << keysym << " x" << last.count << '\n';
+      return true;
+    }
+  }
+  return irSendKey(device, key);
+}
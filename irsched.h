@@ -0,0 +1,34 @@
+#pragma once
+
+#include "profiles.h"
+
+// Per device IR transmit pacing.  Keys for a device are sent in order, a
+// key goes out immediately when the device is idle and is otherwise held
+// until its transmitter (lirctx.h) finished the previous one and the
+// profile gap (or the settle time after power-on) has passed, using a
+// dispatch timer rather than sleeping.  SEND_STOP is never held as it only
+// ends the repeat started by its SEND_START.
+//
+// irSendBatch() merges a press into a SEND_ONCE of the same key still
+// waiting in the queue, so presses coming faster than the device takes
+// them go out as one SEND_ONCE with a repeat count instead of falling
+// behind.
+//
+// Only to be used from the dispatch thread.
+
+#define IRSCHED_QUEUE 16
+// Most presses merged into one SEND_ONCE
+#define IRSCHED_MAX_COUNT 10
+
+enum IrSendType {
+  IR_SEND_ONCE,
+  IR_SEND_START,
+  IR_SEND_STOP
+};
+
+// Queue a key for the device (profile index).  False if the device is
+// unknown or its queue is full, lircd failures are reported by irTransmit().
+bool irSend(int device, const char *keysym, IrSendType type = IR_SEND_ONCE);
+bool irSendKey(int device, IrKey key, IrSendType type = IR_SEND_ONCE);
+// One press of key, merged into a queued SEND_ONCE of it if there is one
+bool irSendBatch(int device, IrKey key);
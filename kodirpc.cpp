@@ -0,0 +1,271 @@
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cec-lirc.h"
+#include "kodirpc.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+// Nothing Kodi sends unprompted comes near this, a larger object means the
+// stream is out of step
+#define KODI_RPC_MAX_OBJECT 65536
+
+enum {
+  ID_PLAYERS = 1,
+  ID_SCREENSAVER
+};
+
+static const char queries[] =
+    "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"Player.GetActivePlayers\"}"
+    "{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"XBMC.GetInfoBooleans\","
+    "\"params\":{\"booleans\":[\"System.ScreenSaverActive\"]}}";
+
+static struct sockaddr_in kodiAddr;
+static thread client;
+static atomic<bool> stopClient(false);
+static atomic<KodiPlayer> player(KODI_PLAYER_UNKNOWN);
+static atomic<int> screensaver(-1);
+
+static const char *playerNames[] = { "unknown", "stopped", "paused",
+    "playing" };
+
+static void setPlayer(KodiPlayer p) {
+  if (player.exchange(p) != p) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "kodirpc: player " << playerNames[p] << endl;
+  }
+}
+
+static void setScreensaver(int active) {
+  if (screensaver.exchange(active) != active) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "kodirpc: screensaver " << active << endl;
+  }
+}
+
+// Start of the value of "name" in a JSON object, null if there is none
+static const char *jsonValue(const string &object, const char *name) {
+  string key = string("\"") + name + "\"";
+  size_t at = object.find(key);
+  if (at == string::npos) {
+    return nullptr;
+  }
+  const char *p = object.c_str() + at + key.size();
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == ':') {
+    p++;
+  }
+  return p;
+}
+
+static bool startsWith(const char *p, const char *prefix) {
+  return p && strncmp(p, prefix, strlen(prefix)) == 0;
+}
+
+static void handleObject(const string &object) {
+  const char *method = jsonValue(object, "method");
+
+  if (method) {
+    if (startsWith(method, "\"Player.OnPlay\"")
+        || startsWith(method, "\"Player.OnResume\"")
+        || startsWith(method, "\"Player.OnAVStart\"")) {
+      setPlayer(KODI_PLAYER_PLAYING);
+    } else if (startsWith(method, "\"Player.OnPause\"")) {
+      setPlayer(KODI_PLAYER_PAUSED);
+    } else if (startsWith(method, "\"Player.OnStop\"")) {
+      setPlayer(KODI_PLAYER_STOPPED);
+    } else if (startsWith(method, "\"GUI.OnScreensaverActivated\"")) {
+      setScreensaver(1);
+    } else if (startsWith(method, "\"GUI.OnScreensaverDeactivated\"")) {
+      setScreensaver(0);
+    }
+    return;
+  }
+
+  // Replies to the queries sent on connect
+  const char *id = jsonValue(object, "id");
+  const char *result = jsonValue(object, "result");
+  if (!id || !result) {
+    return;
+  }
+  switch (atoi(id)) {
+  case ID_PLAYERS:
+    // An empty array when nothing plays.  Whether a player is paused is
+    // not part of the reply, the next OnPause or OnResume tells.
+    if (*result == '[') {
+      result++;
+      while (*result == ' ' || *result == '\r' || *result == '\n') {
+        result++;
+      }
+      setPlayer(*result == ']' ? KODI_PLAYER_STOPPED : KODI_PLAYER_PLAYING);
+    }
+    break;
+  case ID_SCREENSAVER: {
+    const char *active = jsonValue(object, "System.ScreenSaverActive");
+    if (active) {
+      setScreensaver(startsWith(active, "true"));
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Kodi sends JSON objects back to back without a separator, split them by
+// brace depth
+static bool splitObjects(string &buffer) {
+  int depth = 0;
+  bool inString = false;
+  bool escape = false;
+  size_t start = 0;
+  size_t used = 0;
+
+  for (size_t i = 0; i < buffer.size(); i++) {
+    char c = buffer[i];
+    if (inString) {
+      if (escape) {
+        escape = false;
+      } else if (c == '\\') {
+        escape = true;
+      } else if (c == '"') {
+        inString = false;
+      }
+    } else if (c == '"') {
+      inString = true;
+    } else if (c == '{') {
+      if (depth++ == 0) {
+        start = i;
+      }
+    } else if (c == '}' && depth > 0 && --depth == 0) {
+      handleObject(buffer.substr(start, i + 1 - start));
+      used = i + 1;
+    }
+  }
+  // Keep the incomplete object for the next read
+  buffer.erase(0, used);
+  return buffer.size() <= KODI_RPC_MAX_OBJECT;
+}
+
+static int connectKodi() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *) &kodiAddr, sizeof(kodiAddr)) < 0
+      && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  struct pollfd pfd = { fd, POLLOUT, 0 };
+  int error = 0;
+  socklen_t len = sizeof(error);
+  watchdogStep("kodi rpc connect");
+  if (poll(&pfd, 1, 1000) != 1
+      || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+    close(fd);
+    return -1;
+  }
+  if (write(fd, queries, sizeof(queries) - 1) != sizeof(queries) - 1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void clientLoop() {
+  int fd = -1;
+  uint64_t retryNs = 0;
+  string buffer;
+  char buf[4096];
+
+  while (!stopClient) {
+    watchdogBeat("kodi rpc");
+    if (fd < 0) {
+      if (metricsNow() < retryNs) {
+        this_thread::sleep_for(chrono::milliseconds(500));
+        continue;
+      }
+      retryNs = metricsNow() + KODI_RPC_RETRY_MS * 1000000ull;
+      if ((fd = connectKodi()) < 0) {
+        continue;
+      }
+      (logMask & CEC_LOG_DEBUG) && cout << "kodirpc: connected" << endl;
+      buffer.clear();
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      continue;
+    }
+    buffer.append(buf, n > 0 ? n : 0);
+    if (n <= 0 || !splitObjects(buffer)) {
+      cerr << "kodirpc: connection to Kodi "
+          << (n <= 0 ? "lost" : "out of step") << endl;
+      close(fd);
+      fd = -1;
+      setPlayer(KODI_PLAYER_UNKNOWN);
+      setScreensaver(-1);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool kodiRpcStart(const char *addr) {
+  string host = "127.0.0.1";
+  const char *port = addr;
+  const char *colon = strrchr(addr, ':');
+
+  if (colon) {
+    host.assign(addr, colon - addr);
+    port = colon + 1;
+  }
+  memset(&kodiAddr, 0, sizeof(kodiAddr));
+  kodiAddr.sin_family = AF_INET;
+  kodiAddr.sin_port = htons(atoi(port));
+  if (inet_pton(AF_INET, host.c_str(), &kodiAddr.sin_addr) != 1
+      || !kodiAddr.sin_port) {
+    cerr << "kodirpc: bad address " << addr << endl;
+    return false;
+  }
+
+  client = thread(clientLoop);
+  // Early exits from main() must not destroy a joinable thread
+  atexit(kodiRpcStop);
+  return true;
+}
+
+void kodiRpcStop() {
+  if (!client.joinable()) {
+    return;
+  }
+  stopClient = true;
+  client.join();
+}
+
+KodiPlayer kodiRpcPlayer() {
+  return player;
+}
+
+bool kodiRpcScreensaver() {
+  return screensaver == 1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Kodi JSON-RPC client.  A thread keeps a TCP connection to Kodi's JSON-RPC
+// port and follows the player and the screensaver from the notifications
+// Kodi pushes (Player.OnPlay, GUI.OnScreensaverActivated, ...), asking for
+// both once after every connect.  Handlers read the last known state
+// without a round trip.  While there is no connection the state is
+// unknown and the bridge sends stop and notifications as without the
+// client.
+
+#define KODI_RPC_PORT     9090
+#define KODI_RPC_RETRY_MS 5000
+
+enum KodiPlayer {
+  KODI_PLAYER_UNKNOWN,
+  KODI_PLAYER_STOPPED,
+  KODI_PLAYER_PAUSED,
+  KODI_PLAYER_PLAYING
+};
+
+// addr is [host:]port (host defaults to 127.0.0.1)
+bool kodiRpcStart(const char *addr);
+void kodiRpcStop();
+
+// Any thread
+KodiPlayer kodiRpcPlayer();
+// The screensaver is known to be active
+bool kodiRpcScreensaver();
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "alloccheck.h"
+#include "cec-lirc.h"
+#include "dispatch.h"
+#include "lirctx.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+struct LircTxEntry {
+  int tx;
+  int device;
+  const char *keysym;   // points into a profile or rule, both outlive us
+  IrSendType type;
+  unsigned count;
+  LircTxDone done;
+  bool ok;
+};
+
+// Single producer (the dispatch thread), single consumer (the transmitter
+// thread).  An entry stays taken until its completion ran on the dispatch
+// thread.
+struct LircTransmitter {
+  const char *path;     // the first profile's socket setting
+  char name[64];        // watchdog name
+  int fd;
+  int wakeFd;
+  thread worker;
+  LircTxEntry queue[LIRC_TX_QUEUE];
+  atomic<uint32_t> tail;    // queued, written by the dispatch thread
+  atomic<uint32_t> head;    // sent, written by the transmitter thread
+  uint32_t released;        // completions run, dispatch thread only
+};
+
+static LircTransmitter transmitters[PROFILES_MAX];
+static unsigned transmitterCount = 0;
+static int deviceTx[PROFILES_MAX];
+static atomic<bool> stopping(false);
+
+static void completed(void *arg) {
+  LircTxEntry e = *(LircTxEntry *) arg;
+  transmitters[e.tx].released++;
+  e.done(e.device, e.keysym, e.type, e.ok);
+}
+
+static void transmitLoop(LircTransmitter *t) {
+  struct pollfd pfd = { t->wakeFd, POLLIN, 0 };
+  uint32_t head = t->head.load(memory_order_relaxed);
+
+  for (;;) {
+    watchdogBeat(t->name);
+    if (head == t->tail.load(memory_order_acquire)) {
+      if (stopping) {
+        break;
+      }
+      if (poll(&pfd, 1, 500) > 0) {
+        uint64_t count;
+        if (read(t->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+          cerr << "lircTx: eventfd read " << strerror(errno) << endl;
+        }
+      }
+      continue;
+    }
+
+    LircTxEntry &e = t->queue[head % LIRC_TX_QUEUE];
+    {
+      AllocScope scope(ALLOC_IR_SEND);
+      e.ok = irTransmit(t->fd, profileGet(e.device), e.keysym, e.type,
+          e.count);
+    }
+    t->head.store(++head, memory_order_release);
+    while (!dispatchCall(completed, &e)) {
+      if (stopping) {
+        break;
+      }
+      this_thread::yield();
+    }
+  }
+}
+
+bool lircTxStart(LircTxConnect connect) {
+  for (unsigned i = 0; i < profileCount(); i++) {
+    const char *path = profileGet(i).socket.c_str();
+    unsigned tx = 0;
+    while (tx < transmitterCount && strcmp(transmitters[tx].path, path)) {
+      tx++;
+    }
+    deviceTx[i] = tx;
+    if (tx < transmitterCount) {
+      continue;
+    }
+
+    LircTransmitter &t = transmitters[tx];
+    t.path = path;
+    snprintf(t.name, sizeof(t.name), "lircd %s", path);
+    t.fd = connect(path);
+    if (t.fd < 0) {
+      cerr << "lircTxStart: cannot connect to " << path << endl;
+      return false;
+    }
+    t.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t.wakeFd < 0) {
+      cerr << "lircTxStart: eventfd " << strerror(errno) << endl;
+      close(t.fd);
+      return false;
+    }
+    transmitterCount++;
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "lircTxStart: " << path << " fd " << t.fd << endl;
+  }
+
+  for (unsigned tx = 0; tx < transmitterCount; tx++) {
+    transmitters[tx].worker = thread(transmitLoop, &transmitters[tx]);
+  }
+  // Early exits from main() must not destroy a joinable thread
+  atexit(lircTxStop);
+  return true;
+}
+
+void lircTxStop() {
+  stopping = true;
+  for (unsigned tx = 0; tx < transmitterCount; tx++) {
+    LircTransmitter &t = transmitters[tx];
+    if (!t.worker.joinable()) {
+      continue;
+    }
+    uint64_t one = 1;
+    if (write(t.wakeFd, &one, sizeof(one)) < 0) {
+      // the loop still wakes up on its poll timeout
+    }
+    t.worker.join();
+    close(t.wakeFd);
+    close(t.fd);
+  }
+}
+
+bool lircTxSend(int device, const char *keysym, IrSendType type,
+    unsigned count, LircTxDone done) {
+  LircTransmitter &t = transmitters[deviceTx[device]];
+  uint32_t tail = t.tail.load(memory_order_relaxed);
+
+  if (stopping || tail - t.released == LIRC_TX_QUEUE) {
+    return false;
+  }
+  t.queue[tail % LIRC_TX_QUEUE] = { deviceTx[device], device, keysym, type,
+      count, done, false };
+  t.tail.store(tail + 1, memory_order_release);
+
+  uint64_t one = 1;
+  if (write(t.wakeFd, &one, sizeof(one)) < 0) {
+    // the loop still wakes up on its poll timeout
+  }
+  return true;
+}
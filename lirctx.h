@@ -0,0 +1,36 @@
+#pragma once
+
+#include "irsched.h"
+
+// lircd transmitters.  Every lircd socket named by the IR profiles (the
+// profile's socket setting) is a transmitter with its own connection, send
+// queue and thread, so an IR target is the socket, the remote and the key.
+// The dispatch thread queues a send and goes on; a transmitter sends its
+// queue in order while the others send in parallel, and each completion
+// comes back to the dispatch thread through dispatchCall().
+
+#define LIRC_TX_QUEUE 16
+
+// Returns a connected fd for the lircd socket at path, negative on failure
+typedef int (*LircTxConnect)(const char *path);
+
+// Connects a transmitter for every socket the profiles use.  Must be
+// called after profilesLoad() and before the dispatch thread starts.
+bool lircTxStart(LircTxConnect connect);
+// Sends what is still queued and closes the connections
+void lircTxStop();
+
+// Runs on the dispatch thread once the send is done
+typedef void (*LircTxDone)(int device, const char *keysym, IrSendType type,
+    bool ok);
+
+// Queue a send for the device (profile index), false if its transmitter's
+// queue is full.  Only to be used from the dispatch thread.
+bool lircTxSend(int device, const char *keysym, IrSendType type,
+    unsigned count, LircTxDone done);
+
+// Does the actual lircd send on fd, implemented in cec-lirc.cpp and called
+// on the transmitter threads.  count > 1 only for SEND_ONCE, the code then
+// goes out count times.
+bool irTransmit(int fd, const IrProfile &profile, const char *keysym,
+    IrSendType type, unsigned count);
@@ -0,0 +1,391 @@
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cec-lirc.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+// Upper bounds of the latency buckets in microseconds, +Inf is implicit
+static const uint64_t bucketUs[] = { 50, 100, 250, 500, 1000, 2500, 5000,
+    10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000 };
+static const int BUCKETS = sizeof(bucketUs) / sizeof(bucketUs[0]);
+
+struct Histogram {
+  atomic<uint64_t> bucket[BUCKETS + 1];
+  atomic<uint64_t> count;
+  atomic<uint64_t> sumNs;
+
+  void observe(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int i = 0;
+    while (i < BUCKETS && us > bucketUs[i]) {
+      i++;
+    }
+    bucket[i].fetch_add(1, memory_order_relaxed);
+    sumNs.fetch_add(ns, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+  }
+};
+
+// Zero initialised as they have static storage duration
+static Histogram opcodeHist[256];
+static Histogram keyHist[256];
+static atomic<uint64_t> keyUnknown[256];
+static Histogram backendHist[METRICS_BACKEND_COUNT];
+static atomic<uint64_t> backendFail[METRICS_BACKEND_COUNT];
+static Histogram audioHist[METRICS_AUDIO_COUNT];
+static Histogram gestureHist[METRICS_GESTURE_COUNT];
+static Histogram cecWaitHist[CEC_PRIO_COUNT];
+static atomic<uint64_t> cecFail[CEC_PRIO_COUNT];
+static atomic<uint64_t> cecCoalesced[CEC_PRIO_COUNT];
+static atomic<uint64_t> cecBusNs[CEC_PRIO_COUNT];
+static atomic<uint64_t> duplicates[DEDUPE_CLASSES];
+
+static const char *backendName[METRICS_BACKEND_COUNT] = {
+    "lirc_send_packet", "lirc_send_one", "kodi_send" };
+static const char *audioName[METRICS_AUDIO_COUNT] = { "on", "off" };
+static const char *gestureName[METRICS_GESTURE_COUNT] = { "short", "long",
+    "single", "double" };
+static const char *priorityName[CEC_PRIO_COUNT] = {
+    "reply", "state", "query" };
+static const char *dedupeName[DEDUPE_CLASSES] = { "key", "state",
+    "request", "other" };
+
+static int listenFd = -1;
+static atomic<bool> stopServer(false);
+static thread server;
+
+uint64_t metricsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+void metricsCecCommand(uint8_t opcode, uint64_t startNs) {
+  opcodeHist[opcode].observe(metricsNow() - startNs);
+}
+
+void metricsKeyPress(uint8_t keycode, bool known, uint64_t startNs) {
+  if (!known) {
+    keyUnknown[keycode].fetch_add(1, memory_order_relaxed);
+  }
+  keyHist[keycode].observe(metricsNow() - startNs);
+}
+
+void metricsBackend(MetricsBackend backend, bool ok, uint64_t startNs) {
+  if (!ok) {
+    backendFail[backend].fetch_add(1, memory_order_relaxed);
+  }
+  backendHist[backend].observe(metricsNow() - startNs);
+}
+
+void metricsAudio(MetricsAudio action, uint64_t startNs) {
+  audioHist[action].observe(metricsNow() - startNs);
+}
+
+void metricsGesture(MetricsGesture gesture, uint64_t pressNs) {
+  gestureHist[gesture].observe(metricsNow() - pressNs);
+}
+
+void metricsCecQueued(CecPriority priority, uint64_t queueNs) {
+  cecWaitHist[priority].observe(metricsNow() - queueNs);
+}
+
+void metricsCecTransmit(CecPriority priority, bool ok, uint64_t busNs) {
+  if (!ok) {
+    cecFail[priority].fetch_add(1, memory_order_relaxed);
+  }
+  cecBusNs[priority].fetch_add(busNs, memory_order_relaxed);
+}
+
+void metricsCecCoalesced(CecPriority priority) {
+  cecCoalesced[priority].fetch_add(1, memory_order_relaxed);
+}
+
+void metricsDuplicate(DedupeClass c) {
+  duplicates[c].fetch_add(1, memory_order_relaxed);
+}
+
+static void writeHistogram(ostringstream &out, const char *name,
+    const string &labels, const Histogram &h) {
+  uint64_t cumulative = 0;
+  string sep = labels.empty() ? "" : ",";
+
+  for (int i = 0; i <= BUCKETS; i++) {
+    cumulative += h.bucket[i].load(memory_order_relaxed);
+    out << name << "_bucket{" << labels << sep << "le=\"";
+    if (i < BUCKETS) {
+      out << double(bucketUs[i]) / 1e6;
+    } else {
+      out << "+Inf";
+    }
+    out << "\"} " << cumulative << "\n";
+  }
+  out << name << "_sum{" << labels << "} "
+      << double(h.sumNs.load(memory_order_relaxed)) / 1e9 << "\n";
+  out << name << "_count{" << labels << "} "
+      << h.count.load(memory_order_relaxed) << "\n";
+}
+
+static string hexLabel(const char *name, unsigned value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%s=\"0x%02x\"", name, value);
+  return buf;
+}
+
+static string render() {
+  ostringstream out;
+
+  out << "# HELP cec_lirc_command_seconds CEC commands handled by opcode\n"
+      << "# TYPE cec_lirc_command_seconds histogram\n";
+  for (unsigned i = 0; i < 256; i++) {
+    if (opcodeHist[i].count.load(memory_order_relaxed)) {
+      writeHistogram(out, "cec_lirc_command_seconds", hexLabel("opcode", i),
+          opcodeHist[i]);
+    }
+  }
+
+  out << "# HELP cec_lirc_keypress_seconds CEC key presses handled by keycode\n"
+      << "# TYPE cec_lirc_keypress_seconds histogram\n";
+  for (unsigned i = 0; i < 256; i++) {
+    if (keyHist[i].count.load(memory_order_relaxed)) {
+      writeHistogram(out, "cec_lirc_keypress_seconds", hexLabel("key", i),
+          keyHist[i]);
+    }
+  }
+
+  out << "# HELP cec_lirc_keypress_unknown_total Key presses with no mapping\n"
+      << "# TYPE cec_lirc_keypress_unknown_total counter\n";
+  for (unsigned i = 0; i < 256; i++) {
+    uint64_t n = keyUnknown[i].load(memory_order_relaxed);
+    if (n) {
+      out << "cec_lirc_keypress_unknown_total{" << hexLabel("key", i) << "} "
+          << n << "\n";
+    }
+  }
+
+  out << "# HELP cec_lirc_backend_seconds lircd and Kodi send calls\n"
+      << "# TYPE cec_lirc_backend_seconds histogram\n";
+  for (int i = 0; i < METRICS_BACKEND_COUNT; i++) {
+    writeHistogram(out, "cec_lirc_backend_seconds",
+        string("backend=\"") + backendName[i] + "\"", backendHist[i]);
+  }
+
+  out << "# HELP cec_lirc_backend_failures_total Failed lircd and Kodi sends\n"
+      << "# TYPE cec_lirc_backend_failures_total counter\n";
+  for (int i = 0; i < METRICS_BACKEND_COUNT; i++) {
+    out << "cec_lirc_backend_failures_total{backend=\"" << backendName[i]
+        << "\"} " << backendFail[i].load(memory_order_relaxed) << "\n";
+  }
+
+  out << "# HELP cec_lirc_audio_seconds turnAudioOn/turnAudioOff invocations\n"
+      << "# TYPE cec_lirc_audio_seconds histogram\n";
+  for (int i = 0; i < METRICS_AUDIO_COUNT; i++) {
+    writeHistogram(out, "cec_lirc_audio_seconds",
+        string("action=\"") + audioName[i] + "\"", audioHist[i]);
+  }
+
+  out << "# HELP cec_lirc_gesture_delay_seconds Key press to the gesture "
+      << "decision\n# TYPE cec_lirc_gesture_delay_seconds histogram\n";
+  for (int i = 0; i < METRICS_GESTURE_COUNT; i++) {
+    writeHistogram(out, "cec_lirc_gesture_delay_seconds",
+        string("gesture=\"") + gestureName[i] + "\"", gestureHist[i]);
+  }
+
+  out << "# HELP cec_lirc_cec_queue_seconds Outgoing CEC requests waiting "
+      << "for the bus\n# TYPE cec_lirc_cec_queue_seconds histogram\n";
+  for (int i = 0; i < CEC_PRIO_COUNT; i++) {
+    writeHistogram(out, "cec_lirc_cec_queue_seconds",
+        string("priority=\"") + priorityName[i] + "\"", cecWaitHist[i]);
+  }
+
+  out << "# HELP cec_lirc_cec_failures_total Outgoing CEC requests that "
+      << "failed\n# TYPE cec_lirc_cec_failures_total counter\n";
+  for (int i = 0; i < CEC_PRIO_COUNT; i++) {
+    out << "cec_lirc_cec_failures_total{priority=\"" << priorityName[i]
+        << "\"} " << cecFail[i].load(memory_order_relaxed) << "\n";
+  }
+
+  out << "# HELP cec_lirc_cec_coalesced_total Outgoing CEC requests merged "
+      << "into a pending one\n# TYPE cec_lirc_cec_coalesced_total counter\n";
+  for (int i = 0; i < CEC_PRIO_COUNT; i++) {
+    out << "cec_lirc_cec_coalesced_total{priority=\"" << priorityName[i]
+        << "\"} " << cecCoalesced[i].load(memory_order_relaxed) << "\n";
+  }
+
+  // rate() of this is the share of the bus the bridge keeps busy
+  out << "# HELP cec_lirc_cec_bus_seconds_total Estimated bus time of "
+      << "outgoing CEC requests\n# TYPE cec_lirc_cec_bus_seconds_total "
+      << "counter\n";
+  for (int i = 0; i < CEC_PRIO_COUNT; i++) {
+    out << "cec_lirc_cec_bus_seconds_total{priority=\"" << priorityName[i]
+        << "\"} " << double(cecBusNs[i].load(memory_order_relaxed)) / 1e9
+        << "\n";
+  }
+
+  out << "# HELP cec_lirc_duplicates_total Inbound CEC frames and key "
+      << "presses dropped as duplicates\n"
+      << "# TYPE cec_lirc_duplicates_total counter\n";
+  for (int i = 0; i < DEDUPE_CLASSES; i++) {
+    out << "cec_lirc_duplicates_total{class=\"" << dedupeName[i] << "\"} "
+        << duplicates[i].load(memory_order_relaxed) << "\n";
+  }
+
+  return out.str();
+}
+
+// A scraper that stops reading is dropped after this long, well within
+// half of any sensible WatchdogSec
+#define SEND_TIMEOUT_MS 1000
+
+static void serve(int fd) {
+  char request[1024];
+  struct pollfd pfd = { fd, POLLIN, 0 };
+
+  // Swallow the HTTP request if the scraper sends one, plain readers
+  // (nc, socat) get the body right away
+  if (poll(&pfd, 1, 100) > 0) {
+    if (read(fd, request, sizeof(request)) <= 0) {
+      return;
+    }
+  }
+
+  string body = render();
+  string response = "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+
+  // Each send() waits for the timeout at most, the deadline bounds a
+  // client that keeps reading a few bytes at a time
+  struct timeval tv = { SEND_TIMEOUT_MS / 1000, SEND_TIMEOUT_MS % 1000 * 1000 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  uint64_t deadline = metricsNow() + SEND_TIMEOUT_MS * 1000000ull;
+
+  const char *p = response.data();
+  size_t left = response.size();
+  while (left > 0 && metricsNow() < deadline) {
+    // A client gone early must not raise SIGPIPE
+    ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+    if (n <= 0) {
+      break;
+    }
+    p += n;
+    left -= n;
+  }
+}
+
+static void serverLoop() {
+  struct pollfd pfd = { listenFd, POLLIN, 0 };
+
+  while (!stopServer) {
+    watchdogBeat("metrics server");
+    if (poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    serve(fd);
+    close(fd);
+  }
+}
+
+static int listenUnix(const char *path) {
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "metrics: socket path too long " << path << endl;
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int listenTcp(const char *hostPort) {
+  struct sockaddr_in addr;
+  string host = "127.0.0.1";
+  const char *port = hostPort;
+  const char *colon = strrchr(hostPort, ':');
+
+  if (colon) {
+    host.assign(hostPort, colon - hostPort);
+    port = colon + 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(port));
+  if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+    cerr << "metrics: bad address " << hostPort << endl;
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool metricsStart(const char *addr) {
+  listenFd = (addr[0] == '/') ? listenUnix(addr) : listenTcp(addr);
+  if (listenFd < 0 || listen(listenFd, 4) < 0) {
+    cerr << "metrics: failed to listen on " << addr << ": "
+        << strerror(errno) << endl;
+    if (listenFd >= 0) {
+      close(listenFd);
+      listenFd = -1;
+    }
+    return false;
+  }
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "metrics: listening on " << addr << endl;
+
+  server = thread(serverLoop);
+  // Early exits from main() must not destroy a joinable thread
+  atexit(metricsStop);
+  return true;
+}
+
+void metricsStop() {
+  if (!server.joinable()) {
+    return;
+  }
+  stopServer = true;
+  server.join();
+  close(listenFd);
+  listenFd = -1;
+}
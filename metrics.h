@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cecsched.h"
+#include "dedupe.h"
+
+// Lock-free counters and latency histograms for the bridge.  The record
+// functions are called from the libcec callback threads and only do relaxed
+// atomic adds.  metricsStart() spawns a thread that renders the values in
+// Prometheus text format to anyone connecting to the metrics socket.
+
+enum MetricsBackend {
+  METRICS_LIRC_SEND_PACKET,
+  METRICS_LIRC_SEND_ONE,
+  METRICS_KODI_SEND,
+  METRICS_BACKEND_COUNT
+};
+
+enum MetricsAudio {
+  METRICS_AUDIO_ON,
+  METRICS_AUDIO_OFF,
+  METRICS_AUDIO_COUNT
+};
+
+// Key gesture decisions (gesture.h)
+enum MetricsGesture {
+  METRICS_GESTURE_SHORT,    // long press key released in time
+  METRICS_GESTURE_LONG,
+  METRICS_GESTURE_SINGLE,   // no second press came
+  METRICS_GESTURE_DOUBLE,
+  METRICS_GESTURE_COUNT
+};
+
+// Monotonic timestamp in nanoseconds
+uint64_t metricsNow();
+
+void metricsCecCommand(uint8_t opcode, uint64_t startNs);
+void metricsKeyPress(uint8_t keycode, bool known, uint64_t startNs);
+void metricsBackend(MetricsBackend backend, bool ok, uint64_t startNs);
+void metricsAudio(MetricsAudio action, uint64_t startNs);
+// pressNs is when the key was pressed
+void metricsGesture(MetricsGesture gesture, uint64_t pressNs);
+// Outgoing CEC scheduler: queueNs is when the request was queued, busNs its
+// estimated bus time
+void metricsCecQueued(CecPriority priority, uint64_t queueNs);
+void metricsCecTransmit(CecPriority priority, bool ok, uint64_t busNs);
+void metricsCecCoalesced(CecPriority priority);
+// Inbound frame dropped as a duplicate (dedupe.h)
+void metricsDuplicate(DedupeClass c);
+
+// addr is either an absolute path for a Unix socket or [host:]port for TCP
+// (host defaults to 127.0.0.1)
+bool metricsStart(const char *addr);
+void metricsStop();
@@ -0,0 +1,264 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cec-lirc.h"
+#include "profiles.h"
+
+using namespace std;
+using namespace CEC;
+
+// The amp the bridge was written for.  The RAV283 drops a code that starts
+// less than ~100 ms after the previous one and ignores IR for about 2 s
+// after power on.
+static const char defaultProfiles[] =
+    "[amp]\n"
+    "remote       Yamaha_RAV283\n"
+    "power-on     KEY_POWER\n"
+    "power-off    KEY_SUSPEND\n"
+    "volume-up    KEY_VOLUMEUP\n"
+    "volume-down  KEY_VOLUMEDOWN\n"
+    "mute         KEY_MUTE\n"
+    "gap          120\n"
+    "settle       2000\n"
+    "volume       30\n"
+    "volume-step  2\n"
+    "volume-repeat 150\n"
+    // LPCM 2ch 32-192 kHz 16/20/24 bit, AC-3 5.1 640 kbit/s,
+    // DTS 5.1 1536 kbit/s
+    "sad          09:7f:07\n"
+    "sad          15:07:50\n"
+    "sad          3d:07:c0\n";
+
+static const char *keyNames[IR_KEYS] = { "power-on", "power-off", "volume-up",
+    "volume-down", "mute" };
+
+static vector<IrProfile> profiles;
+
+static bool parseNumber(const string &tok, unsigned max, unsigned &value) {
+  char *end;
+  unsigned long v = strtoul(tok.c_str(), &end, 10);
+  if (tok.empty() || *end || v > max) {
+    return false;
+  }
+  value = v;
+  return true;
+}
+
+static bool parseSad(const string &tok, IrProfile &p) {
+  unsigned b[3];
+  char end;
+  if (p.sadCount == PROFILE_MAX_SADS
+      || sscanf(tok.c_str(), "%2x:%2x:%2x%c", &b[0], &b[1], &b[2], &end) != 3) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    p.sads[p.sadCount][i] = b[i];
+  }
+  p.sadCount++;
+  return true;
+}
+
+static bool parseSetting(IrProfile &p, const string &name,
+    const string &value) {
+  if (name == "remote") {
+    p.remote = value;
+    return true;
+  }
+  if (name == "socket") {
+    p.socket = value;
+    return true;
+  }
+  if (name == "gap") {
+    return parseNumber(value, 60000, p.gapMs);
+  }
+  if (name == "settle") {
+    return parseNumber(value, 60000, p.settleMs);
+  }
+  if (name == "volume") {
+    return parseNumber(value, 100, p.volume);
+  }
+  if (name == "volume-step") {
+    return parseNumber(value, 100, p.volumeStep);
+  }
+  if (name == "volume-repeat") {
+    return parseNumber(value, 60000, p.volumeRepeatMs);
+  }
+  if (name == "sad") {
+    return parseSad(value, p);
+  }
+  if (name == "key") {
+    p.extraKeys.push_back(value);
+    return true;
+  }
+  for (int k = 0; k < IR_KEYS; k++) {
+    if (name == keyNames[k]) {
+      p.keys[k] = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parseProfiles(istream &in, const char *source,
+    vector<IrProfile> &out) {
+  string line;
+  unsigned lineNo = 0;
+
+  while (getline(in, line)) {
+    lineNo++;
+    istringstream ss(line.substr(0, line.find('#')));
+    string name, value, extra;
+    if (!(ss >> name)) {
+      continue;
+    }
+
+    if (name.front() == '[') {
+      if (name.size() < 3 || name.back() != ']' || (ss >> extra)) {
+        cerr << source << ":" << lineNo << ": invalid section: " << line
+            << endl;
+        return false;
+      }
+      IrProfile p;
+      p.name = name.substr(1, name.size() - 2);
+      p.socket = PROFILE_SOCKET;
+      p.gapMs = 0;
+      p.settleMs = 0;
+      p.volume = 30;
+      p.volumeStep = 2;
+      p.volumeRepeatMs = 150;
+      p.sadCount = 0;
+      out.push_back(p);
+      continue;
+    }
+
+    if (out.empty() || !(ss >> value) || (ss >> extra)
+        || !parseSetting(out.back(), name, value)) {
+      cerr << source << ":" << lineNo << ": invalid setting: " << line << endl;
+      return false;
+    }
+  }
+
+  for (auto &p : out) {
+    if (p.remote.empty()) {
+      cerr << source << ": profile " << p.name << " has no remote" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool profilesLoad(const char *path) {
+  vector<IrProfile> loaded;
+
+  istringstream defaults(defaultProfiles);
+  if (!parseProfiles(defaults, "defaults", loaded)) {
+    return false;
+  }
+  if (path) {
+    ifstream file(path);
+    vector<IrProfile> user;
+    if (!file) {
+      cerr << "profilesLoad: cannot open " << path << endl;
+      return false;
+    }
+    if (!parseProfiles(file, path, user)) {
+      return false;
+    }
+    for (auto &p : user) {
+      auto it = loaded.begin();
+      while (it != loaded.end() && it->name != p.name) {
+        ++it;
+      }
+      if (it != loaded.end()) {
+        *it = p;
+      } else {
+        loaded.push_back(p);
+      }
+    }
+  }
+  if (loaded.size() > PROFILES_MAX) {
+    cerr << "profilesLoad: more than " << PROFILES_MAX << " profiles" << endl;
+    return false;
+  }
+  profiles.swap(loaded);
+
+  if (logMask & CEC_LOG_DEBUG) {
+    for (auto &p : profiles) {
+      cout << "profilesLoad: " << p.name << " remote " << p.remote << " on "
+          << p.socket << " gap " << p.gapMs << " ms settle " << p.settleMs
+          << " ms" << endl;
+    }
+  }
+  return true;
+}
+
+int profileFind(const char *name) {
+  for (size_t i = 0; i < profiles.size(); i++) {
+    if (profiles[i].name == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int profileFind(const char *name, size_t len) {
+  for (size_t i = 0; i < profiles.size(); i++) {
+    if (profiles[i].name.compare(0, string::npos, name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const IrProfile &profileGet(int index) {
+  return profiles[index];
+}
+
+const char *profileKey(int index, const char *keysym) {
+  const IrProfile &p = profiles[index];
+
+  for (auto &k : p.keys) {
+    if (!k.empty() && k == keysym) {
+      return k.c_str();
+    }
+  }
+  for (auto &k : p.extraKeys) {
+    if (k == keysym) {
+      return k.c_str();
+    }
+  }
+  return nullptr;
+}
+
+unsigned profileCount() {
+  return profiles.size();
+}
+
+unsigned profileSads(int index, const uint8_t *formats, unsigned count,
+    uint8_t out[4][3]) {
+  const IrProfile &p = profiles[index];
+  unsigned n = 0;
+
+  for (unsigned i = 0; i < count && n < 4; i++) {
+    unsigned id = formats[i] >> 6;
+    unsigned code = formats[i] & 0x3f;
+
+    for (unsigned j = 0; j < p.sadCount; j++) {
+      const uint8_t *sad = p.sads[j];
+      unsigned sadCode = (sad[0] >> 3) & 0x0f;
+      // id 0 is the basic audio format code, id 1 the extension type code
+      // of formats with code 15
+      if ((id == 0 && sadCode == code)
+          || (id == 1 && sadCode == 15 && (sad[2] >> 3) == code)) {
+        memcpy(out[n++], sad, 3);
+        break;
+      }
+    }
+  }
+  return n;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// IR device profiles.  A profiles file is made of sections
+//
+//   [name]
+//   remote       lircd remote name
+//   socket       lircd socket the remote is sent through (PROFILE_SOCKET by
+//                default), every socket is a transmitter of its own
+//   power-on     key names, see IrKey
+//   ...
+//   gap          minimum ms from the end of one IR frame to the next
+//   settle       ms the device ignores IR after power-on
+//   volume       volume estimate at startup, 0-100
+//   volume-step  volume change per IR volume code
+//   volume-repeat  ms per volume step while a volume key is held
+//   sad          Short Audio Descriptor as 3 hex bytes (e.g. 15:07:50), one
+//                line per supported format, reported in this order
+//   key          further lircd key name the control socket may send, one
+//                line per key
+//
+// Blank lines and text after '#' are ignored.  A profile in the file
+// replaces the built in profile of the same name.  The bridge drives the
+// profile named "amp" unless --amp picks another one.
+
+#define PROFILES_MAX 8
+#define PROFILE_MAX_SADS 16
+#define PROFILE_SOCKET "/var/run/lirc/lircd-tx"
+
+enum IrKey {
+  IR_POWER_ON,
+  IR_POWER_OFF,
+  IR_VOLUME_UP,
+  IR_VOLUME_DOWN,
+  IR_MUTE,
+  IR_KEYS
+};
+
+struct IrProfile {
+  std::string name;
+  std::string remote;
+  std::string socket;
+  std::string keys[IR_KEYS];    // empty when the device has no such key
+  std::vector<std::string> extraKeys;
+  unsigned gapMs;
+  unsigned settleMs;
+  unsigned volume;
+  unsigned volumeStep;
+  unsigned volumeRepeatMs;
+  uint8_t sads[PROFILE_MAX_SADS][3];
+  unsigned sadCount;
+};
+
+// Load the built in profiles plus the optional profiles file (may be null).
+// Must be called before the dispatch thread starts.  Returns false on a
+// parse error.
+bool profilesLoad(const char *path);
+
+// Profile index by name, -1 if there is none
+int profileFind(const char *name);
+// The same for the first len characters of name, without a copy
+int profileFind(const char *name, size_t len);
+const IrProfile &profileGet(int index);
+// The profile's copy of keysym, which lives as long as the process, when
+// it is one of the profile's keys (IrKey or key lines), null otherwise
+const char *profileKey(int index, const char *keysym);
+unsigned profileCount();
+
+// Short Audio Descriptors for a <Request Short Audio Descriptor>.  formats
+// are the request operands ([Audio Format ID] in bits 7-6, [Audio Format
+// Code] in bits 5-0), out receives the matching SADs in request order.
+// Returns the number of SADs copied, at most 4 which is all a CEC frame
+// can carry.
+unsigned profileSads(int index, const uint8_t *formats, unsigned count,
+    uint8_t out[4][3]);
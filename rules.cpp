@@ -0,0 +1,279 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#include "cec-lirc.h"
+#include "rules.h"
+
+using namespace std;
+using namespace CEC;
+
+// Equivalent of the original hardcoded CECCommand switch
+static const char defaultRules[] =
+    // TV standby 0f:36
+    "36  0  *  *   audio-off\n"
+    // From https://www.hdmi.org/docs/Hdmi13aSpecs
+    //
+    // The amplifier comes out of standby (if necessary) and switches to the
+    // relevant connector for device specified by [Physical Address]. It then
+    // sends a <Set System Audio Mode> [On] message.
+    //
+    // <System Audio Mode Request> sent without a [Physical Address]
+    // parameter requests termination of the feature. In this case, the
+    // amplifier sends a <Set System Audio Mode> [Off] message.
+    //
+    // libCEC should return 50:72:01 (on) or 50:72:00 (off), it only does so
+    // after AudioEnable() so system-audio replies before the IR round trip
+    "70  *  *  *   system-audio\n"
+    // Routing change from the TV, TV is on turn audio on unless it switches
+    // between inputs the bridge is not on
+    "80  0  *  *   our-route,audio-on\n"
+    // User changes source (This implies that the TV is on)
+    // TV(0) -> Audio(5): give device power status (8F)
+    "8f  *  5  *   sync-power\n"
+    // TV reports on or standby
+    "90  0  *  00  audio-on\n"
+    "90  0  *  01  audio-off\n"
+    // TV on its way out of standby, a source waking it or the TV selecting
+    // a route while in standby: boot the amp before the TV reports on
+    "90  0  *  02  warm-up\n"
+    "04  *  0  *   warm-up\n"
+    "86  0  *  *   warm-up\n"
+    // We are the audio system, answer from the volume/mute estimate
+    "71  *  5  *   audio-status\n"
+    // ARC/system audio setup, the TV waits for these before using the amp
+    "a4  *  5  *   audio-descriptors\n";
+
+struct RulePredicate {
+  uint8_t opcode;
+  int8_t initiator;     // -1 matches any
+  int8_t destination;   // -1 matches any
+  uint8_t paramCount;
+  uint8_t paramValue[RULES_MAX_PARAMS];
+  uint8_t paramMask[RULES_MAX_PARAMS];
+  uint16_t firstAction;
+  uint8_t actionCount;
+  const char *source;
+  unsigned line;
+};
+
+struct OpcodeRules {
+  uint16_t first;
+  uint16_t count;
+};
+
+static OpcodeRules table[256];
+static vector<RulePredicate> predicates;
+static vector<RuleAction> actions;
+
+static string trim(const string &s) {
+  size_t b = s.find_first_not_of(" \t");
+  size_t e = s.find_last_not_of(" \t\r");
+  return b == string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+static bool parseHex(const string &tok, unsigned max, unsigned &value) {
+  char *end;
+  unsigned long v = strtoul(tok.c_str(), &end, 16);
+  if (tok.empty() || *end || v > max) {
+    return false;
+  }
+  value = v;
+  return true;
+}
+
+static bool parseAddress(const string &tok, int8_t &address) {
+  unsigned v;
+  if (tok == "*") {
+    address = -1;
+    return true;
+  }
+  if (!parseHex(tok, 15, v)) {
+    return false;
+  }
+  address = v;
+  return true;
+}
+
+static bool parseParams(const string &tok, RulePredicate &pred) {
+  pred.paramCount = 0;
+  if (tok == "*") {
+    return true;
+  }
+  stringstream ss(tok);
+  string byte;
+  while (getline(ss, byte, ':')) {
+    unsigned v;
+    if (pred.paramCount == RULES_MAX_PARAMS) {
+      return false;
+    }
+    if (byte == "xx") {
+      pred.paramValue[pred.paramCount] = 0;
+      pred.paramMask[pred.paramCount] = 0;
+    } else if (parseHex(byte, 0xff, v)) {
+      pred.paramValue[pred.paramCount] = v;
+      pred.paramMask[pred.paramCount] = 0xff;
+    } else {
+      return false;
+    }
+    pred.paramCount++;
+  }
+  return true;
+}
+
+static bool parseAction(const string &tok, RuleAction &action) {
+  static const struct {
+    const char *name;
+    RuleActionType type;
+    bool hasArg;
+  } names[] = {
+      { "ignore", RULE_IGNORE, false },
+      { "audio-on", RULE_AUDIO_ON, false },
+      { "audio-off", RULE_AUDIO_OFF, false },
+      { "sync-power", RULE_SYNC_POWER, false },
+      { "kodi-stop", RULE_KODI_STOP, false },
+      { "kodi", RULE_KODI_BUTTON, true },
+      { "notify", RULE_NOTIFY, true },
+      { "ir", RULE_IR, true },
+      { "audio-status", RULE_AUDIO_STATUS, false },
+      { "audio-descriptors", RULE_AUDIO_DESCRIPTORS, false },
+      { "system-audio", RULE_SYSTEM_AUDIO, false },
+      { "our-route", RULE_OUR_ROUTE, false },
+      { "warm-up", RULE_WARM_UP, false } };
+
+  size_t colon = tok.find(':');
+  string name = tok.substr(0, colon);
+  for (auto &n : names) {
+    if (name == n.name && n.hasArg == (colon != string::npos)) {
+      action.type = n.type;
+      action.arg = n.hasArg ? trim(tok.substr(colon + 1)) : "";
+      return !n.hasArg || !action.arg.empty();
+    }
+  }
+  return false;
+}
+
+static bool parseRules(istream &in, const char *source,
+    vector<RulePredicate> &preds, vector<RuleAction> &acts) {
+  string line;
+  unsigned lineNo = 0;
+
+  while (getline(in, line)) {
+    lineNo++;
+    line = trim(line.substr(0, line.find('#')));
+    if (line.empty()) {
+      continue;
+    }
+
+    istringstream ss(line);
+    string opcode, initiator, destination, params, rest;
+    ss >> opcode >> initiator >> destination >> params;
+    getline(ss, rest);
+
+    RulePredicate pred;
+    unsigned op;
+    if (!parseHex(opcode, 0xff, op) || !parseAddress(initiator, pred.initiator)
+        || !parseAddress(destination, pred.destination)
+        || !parseParams(params, pred) || trim(rest).empty()) {
+      cerr << source << ":" << lineNo << ": invalid rule: " << line << endl;
+      return false;
+    }
+    pred.opcode = op;
+    pred.firstAction = acts.size();
+    pred.actionCount = 0;
+    pred.source = source;
+    pred.line = lineNo;
+
+    stringstream as(rest);
+    string tok;
+    while (getline(as, tok, ',')) {
+      RuleAction action;
+      if (!parseAction(trim(tok), action)) {
+        cerr << source << ":" << lineNo << ": invalid action: " << trim(tok)
+            << endl;
+        return false;
+      }
+      acts.push_back(action);
+      pred.actionCount++;
+    }
+    preds.push_back(pred);
+  }
+  return true;
+}
+
+bool rulesLoad(const char *path) {
+  vector<RulePredicate> preds;
+  vector<RuleAction> acts;
+
+  if (path) {
+    ifstream file(path);
+    if (!file) {
+      cerr << "rulesLoad: cannot open " << path << endl;
+      return false;
+    }
+    // The file name must outlive the table, argv does
+    if (!parseRules(file, path, preds, acts)) {
+      return false;
+    }
+  }
+  istringstream defaults(defaultRules);
+  if (!parseRules(defaults, "defaults", preds, acts)) {
+    return false;
+  }
+
+  // Group by opcode keeping the file order (user rules first) within a group
+  stable_sort(preds.begin(), preds.end(),
+      [](const RulePredicate &a, const RulePredicate &b) {
+        return a.opcode < b.opcode;
+      });
+
+  memset(table, 0, sizeof(table));
+  for (size_t i = 0; i < preds.size(); i++) {
+    OpcodeRules &slot = table[preds[i].opcode];
+    if (slot.count == 0) {
+      slot.first = i;
+    }
+    slot.count++;
+  }
+  predicates.swap(preds);
+  actions.swap(acts);
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "rulesLoad: " << predicates.size() << " rules" << endl;
+  return true;
+}
+
+bool rulesMatch(const cec_command *command, RuleMatch &match) {
+  const OpcodeRules &slot = table[uint8_t(command->opcode)];
+
+  for (unsigned i = slot.first; i < unsigned(slot.first + slot.count); i++) {
+    const RulePredicate &pred = predicates[i];
+
+    if ((pred.initiator >= 0 && pred.initiator != command->initiator)
+        || (pred.destination >= 0 && pred.destination != command->destination)
+        || pred.paramCount > command->parameters.size) {
+      continue;
+    }
+    bool paramsMatch = true;
+    for (unsigned j = 0; j < pred.paramCount; j++) {
+      if ((command->parameters.data[j] & pred.paramMask[j])
+          != pred.paramValue[j]) {
+        paramsMatch = false;
+        break;
+      }
+    }
+    if (!paramsMatch) {
+      continue;
+    }
+
+    match.actions = &actions[pred.firstAction];
+    match.count = pred.actionCount;
+    match.source = pred.source;
+    match.line = pred.line;
+    return true;
+  }
+  return false;
+}
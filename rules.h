@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "libcec/cec.h"
+
+// Declarative CEC command rules.  Each line of a rules file is
+//
+//   opcode  initiator  destination  params  action[,action...]
+//
+// opcode is a hex byte, initiator and destination a hex logical address or
+// '*', params '*' or colon separated hex bytes where 'xx' matches any byte
+// (e.g. 00 or xx:01).  Blank lines and text after '#' are ignored.
+//
+// Rules are compiled into a table indexed by opcode holding a short list of
+// predicates, the first matching predicate for a command wins.  User rules
+// are placed in front of the built in defaults so they can override them.
+
+#define RULES_MAX_PARAMS 4
+
+enum RuleActionType {
+  RULE_IGNORE,      // match and do nothing, used to mask a default
+  RULE_AUDIO_ON,    // turnAudioOn()
+  RULE_AUDIO_OFF,   // turnAudioOff()
+  RULE_SYNC_POWER,  // follow the audio system power status
+  RULE_KODI_STOP,   // stop Kodi playback
+  RULE_KODI_BUTTON, // kodi:<button> send a Kodi button press
+  RULE_NOTIFY,      // notify:<text> Kodi notification
+  RULE_IR,          // ir:<key> send a key with the IR remote
+  RULE_AUDIO_STATUS, // reply with <Report Audio Status>
+  RULE_AUDIO_DESCRIPTORS, // reply with the amp Short Audio Descriptors
+  RULE_SYSTEM_AUDIO, // answer <System Audio Mode Request>, then audio on/off
+  RULE_OUR_ROUTE,   // skip the remaining actions unless the route concerns
+                    // the bridge's branch of the HDMI tree (topology.h)
+  RULE_WARM_UP      // TV is waking up, power the amp ahead (warmup.h)
+};
+
+struct RuleAction {
+  RuleActionType type;
+  std::string arg;
+};
+
+struct RuleMatch {
+  const RuleAction *actions;
+  uint8_t count;
+  const char *source;   // file of the matching rule or "defaults"
+  unsigned line;
+};
+
+// Compile the built in defaults plus the optional rules file (may be null).
+// Must be called before the CEC adapter is opened.  Returns false and leaves
+// the previous table in place on a parse error.
+bool rulesLoad(const char *path);
+
+// Look up the actions for a command.  Returns false if no rule matched.
+bool rulesMatch(const CEC::cec_command *command, RuleMatch &match);
@@ -0,0 +1,1043 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <iomanip>
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cec-lirc.h"
+#include "metrics.h"
+#include "profiles.h"
+#include "simbus.h"
+
+using namespace std;
+using namespace CEC;
+
+#define SIM_RETRIES       1     // libcec's default transmit retries
+#define SIM_QUERY_MS      1000  // libcec waits this long for a reply
+
+enum SimEventType {
+  SIM_FRAME,
+  SIM_POWER,
+  SIM_KEY,
+  SIM_MARK,
+  SIM_KODI,
+  SIM_END
+};
+
+struct SimEvent {
+  uint64_t atNs;
+  SimEventType type;
+  cec_command command;      // SIM_FRAME, SIM_KEY
+  uint8_t la;               // SIM_POWER
+  cec_power_status power;   // SIM_POWER
+  unsigned holdMs;          // SIM_KEY
+  string kodi;              // SIM_KODI
+};
+
+struct SimDevice {
+  bool present;
+  uint16_t physical;
+  cec_power_status power;
+  string name;
+};
+
+struct SimWaiter {
+  bool done;
+  bool ok;
+};
+
+struct SimFrame {
+  cec_command command;
+  uint64_t readyNs;
+  int retries;              // left
+  bool retry;
+  SimWaiter *waiter;        // bridge Transmit() waiting for the ack
+};
+
+struct SimQuery {
+  cec_logical_address from;
+  cec_opcode opcode;
+  bool done;
+  uint8_t value;
+};
+
+static mutex simLock;
+static condition_variable busCv;    // new frames for the bus
+static condition_variable doneCv;   // acks and query replies
+static deque<SimFrame> pending;
+static vector<SimQuery *> queries;
+static SimDevice devices[16];
+static cec_logical_address bridgeAudio = CECDEVICE_AUDIOSYSTEM;
+static cec_logical_address bridgePlayback = CECDEVICE_PLAYBACKDEVICE1;
+static uint16_t bridgePhysical = 0x2000;
+static bool bridgeActive = false;
+static unsigned replyMs = 30;
+static unsigned irMs = SIM_IR_MS;
+static vector<SimEvent> events;
+static ICECCallbacks *callbacks = nullptr;
+static void *callbackParam = nullptr;
+
+static uint64_t startNs = 0;
+static uint64_t markNs = 0;
+static uint64_t busFreeNs = 0;
+static int lastInitiator = -1;
+static uint8_t pressedKey = CEC_USER_CONTROL_CODE_UNKNOWN;
+static uint64_t pressedNs = 0;
+
+static unsigned frames = 0;
+static unsigned nacks = 0;
+static unsigned retries = 0;
+static uint64_t busyNs = 0;
+static uint64_t systemAudioNs = 0;
+static uint64_t firstIrNs = 0;
+static string firstIr;
+
+static atomic<bool> finished(false);
+static atomic<bool> stopSim(false);
+static thread busThread;
+static thread scriptThread;
+
+// lircd stand-ins, one per transmitter socket
+struct SimLircd {
+  const char *path;
+  int fds[2];           // the bridge's end, ours
+  thread worker;
+};
+
+static SimLircd lircds[PROFILES_MAX];
+static unsigned lircdCount = 0;
+
+// Kodi JSON-RPC stand-in
+static unsigned kodiPort = 0;
+static thread kodiThread;
+static int kodiListenFd = -1;
+static int kodiFd = -1;
+static string kodiPlayer = "stopped";
+static bool kodiScreensaver = false;
+
+static double sinceMs(uint64_t from, uint64_t ns) {
+  return double(ns - from) / 1000000;
+}
+
+static bool isBridge(int la) {
+  return la == bridgeAudio || la == bridgePlayback;
+}
+
+static bool present(int la) {
+  return la == CECDEVICE_BROADCAST || isBridge(la) || devices[la].present;
+}
+
+static uint8_t deviceType(int la) {
+  switch (la) {
+  case CECDEVICE_TV:
+    return CEC_DEVICE_TYPE_TV;
+  case CECDEVICE_AUDIOSYSTEM:
+    return CEC_DEVICE_TYPE_AUDIO_SYSTEM;
+  case CECDEVICE_TUNER1: case CECDEVICE_TUNER2: case CECDEVICE_TUNER3:
+  case CECDEVICE_TUNER4:
+    return CEC_DEVICE_TYPE_TUNER;
+  case CECDEVICE_PLAYBACKDEVICE1: case CECDEVICE_PLAYBACKDEVICE2:
+  case CECDEVICE_PLAYBACKDEVICE3:
+    return CEC_DEVICE_TYPE_PLAYBACK_DEVICE;
+  default:
+    return CEC_DEVICE_TYPE_RECORDING_DEVICE;
+  }
+}
+
+static string frameString(const cec_command &command) {
+  char buf[3 * (2 + CEC_MAX_DATA_PACKET_SIZE)];
+  int len = snprintf(buf, sizeof(buf), "%x%x", command.initiator,
+      command.destination);
+  if (command.opcode_set) {
+    len += snprintf(buf + len, sizeof(buf) - len, ":%02x", command.opcode);
+  }
+  for (unsigned i = 0; i < command.parameters.size; i++) {
+    len += snprintf(buf + len, sizeof(buf) - len, ":%02x",
+        command.parameters.data[i]);
+  }
+  return buf;
+}
+
+// simLock held
+static void queueFrame(const cec_command &command, uint64_t readyNs,
+    SimWaiter *waiter) {
+  SimFrame frame;
+  frame.command = command;
+  frame.readyNs = readyNs;
+  frame.retries = SIM_RETRIES;
+  frame.retry = false;
+  frame.waiter = waiter;
+  pending.push_back(frame);
+  busCv.notify_one();
+}
+
+static void reply(cec_logical_address from, cec_logical_address to,
+    cec_opcode opcode, const uint8_t *params, unsigned count,
+    uint64_t readyNs) {
+  cec_command command;
+  cec_command::Format(command, from, to, opcode);
+  for (unsigned i = 0; i < count; i++) {
+    command.PushBack(params[i]);
+  }
+  queueFrame(command, readyNs, nullptr);
+}
+
+// What a virtual device does with a frame it received, simLock held
+static void deviceReceive(int la, const cec_command &command, uint64_t now) {
+  SimDevice &d = devices[la];
+  cec_logical_address self = cec_logical_address(la);
+  const uint8_t *p = command.parameters.data;
+  unsigned n = command.parameters.size;
+  uint64_t at = now + uint64_t(replyMs) * 1000000;
+  bool direct = command.destination == la;
+
+  switch (command.opcode) {
+  case CEC_OPCODE_GIVE_DEVICE_POWER_STATUS:
+    if (direct) {
+      uint8_t power = d.power;
+      reply(self, command.initiator, CEC_OPCODE_REPORT_POWER_STATUS, &power, 1,
+          at);
+    }
+    break;
+  case CEC_OPCODE_GIVE_PHYSICAL_ADDRESS:
+    if (direct) {
+      uint8_t report[3] = { uint8_t(d.physical >> 8), uint8_t(d.physical),
+          deviceType(la) };
+      reply(self, CECDEVICE_BROADCAST, CEC_OPCODE_REPORT_PHYSICAL_ADDRESS,
+          report, 3, at);
+    }
+    break;
+  case CEC_OPCODE_GET_CEC_VERSION:
+    if (direct) {
+      uint8_t version = CEC_VERSION_1_4;
+      reply(self, command.initiator, CEC_OPCODE_CEC_VERSION, &version, 1, at);
+    }
+    break;
+  case CEC_OPCODE_STANDBY:
+    d.power = CEC_POWER_STATUS_STANDBY;
+    break;
+  case CEC_OPCODE_IMAGE_VIEW_ON:
+  case CEC_OPCODE_TEXT_VIEW_ON:
+    if (direct && la == CECDEVICE_TV) {
+      d.power = CEC_POWER_STATUS_ON;
+    }
+    break;
+  case CEC_OPCODE_USER_CONTROL_PRESSED:
+    // Power, Power On Function, Power Off Function
+    if (direct && n >= 1 && (p[0] == 0x40 || p[0] == 0x6d)) {
+      d.power = CEC_POWER_STATUS_ON;
+    } else if (direct && n >= 1 && p[0] == 0x6c) {
+      d.power = CEC_POWER_STATUS_STANDBY;
+    }
+    break;
+  case CEC_OPCODE_SET_STREAM_PATH:
+    if (n >= 2 && ((p[0] << 8) | p[1]) == d.physical) {
+      uint8_t active[2] = { p[0], p[1] };
+      d.power = CEC_POWER_STATUS_ON;
+      reply(self, CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE, active, 2, at);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// The libcec side of the bridge: its own automatic replies, pending
+// queries and the callbacks.  simLock held.
+static void bridgeReceive(const cec_command &command, uint64_t now) {
+  cec_logical_address self = isBridge(command.destination)
+      ? command.destination : bridgeAudio;
+  uint64_t at = now + uint64_t(replyMs) * 1000000;
+
+  switch (command.opcode) {
+  case CEC_OPCODE_GIVE_DEVICE_POWER_STATUS:
+    if (isBridge(command.destination)) {
+      uint8_t power = CEC_POWER_STATUS_ON;
+      reply(self, command.initiator, CEC_OPCODE_REPORT_POWER_STATUS, &power, 1,
+          at);
+    }
+    break;
+  case CEC_OPCODE_GIVE_PHYSICAL_ADDRESS:
+    if (isBridge(command.destination)) {
+      uint8_t report[3] = { uint8_t(bridgePhysical >> 8),
+          uint8_t(bridgePhysical), deviceType(self) };
+      reply(self, CECDEVICE_BROADCAST, CEC_OPCODE_REPORT_PHYSICAL_ADDRESS,
+          report, 3, at);
+    }
+    break;
+  case CEC_OPCODE_GET_CEC_VERSION:
+    if (isBridge(command.destination)) {
+      uint8_t version = CEC_VERSION_1_3A;
+      reply(self, command.initiator, CEC_OPCODE_CEC_VERSION, &version, 1, at);
+    }
+    break;
+  default:
+    break;
+  }
+
+  for (auto q : queries) {
+    if (!q->done && q->from == command.initiator && q->opcode == command.opcode
+        && command.parameters.size >= 1) {
+      q->value = command.parameters.data[0];
+      q->done = true;
+      doneCv.notify_all();
+    }
+  }
+
+  if (!callbacks) {
+    return;
+  }
+  // Like libcec the bridge is the active source while routed to, the
+  // change is reported before the command that caused it
+  int route = -1;
+  if (command.opcode == CEC_OPCODE_ROUTING_CHANGE
+      && command.parameters.size >= 4) {
+    route = (command.parameters.data[2] << 8) | command.parameters.data[3];
+  } else if ((command.opcode == CEC_OPCODE_SET_STREAM_PATH
+      || command.opcode == CEC_OPCODE_ACTIVE_SOURCE)
+      && command.parameters.size >= 2) {
+    route = (command.parameters.data[0] << 8) | command.parameters.data[1];
+  }
+  if (route >= 0 && (route == bridgePhysical) != bridgeActive
+      && callbacks->sourceActivated) {
+    bridgeActive = !bridgeActive;
+    callbacks->sourceActivated(callbackParam, bridgeAudio, bridgeActive);
+  }
+  // Keys for other devices are only traffic
+  bool forUs = isBridge(command.destination);
+  if (forUs && command.opcode == CEC_OPCODE_USER_CONTROL_PRESSED
+      && command.parameters.size >= 1 && callbacks->keyPress) {
+    cec_keypress key;
+    key.keycode = cec_user_control_code(command.parameters.data[0]);
+    key.duration = 0;
+    pressedKey = key.keycode;
+    pressedNs = now;
+    callbacks->keyPress(callbackParam, &key);
+  } else if (forUs && command.opcode == CEC_OPCODE_USER_CONTROL_RELEASE
+      && pressedKey != CEC_USER_CONTROL_CODE_UNKNOWN && callbacks->keyPress) {
+    cec_keypress key;
+    key.keycode = cec_user_control_code(pressedKey);
+    key.duration = (now - pressedNs) / 1000000;
+    pressedKey = CEC_USER_CONTROL_CODE_UNKNOWN;
+    callbacks->keyPress(callbackParam, &key);
+  }
+  if (callbacks->commandReceived) {
+    callbacks->commandReceived(callbackParam, &command);
+  }
+}
+
+// A frame made it across the bus, simLock held
+static void deliver(const cec_command &command, uint64_t now) {
+  if (command.opcode == CEC_OPCODE_SET_SYSTEM_AUDIO_MODE
+      && isBridge(command.initiator) && command.parameters.size >= 1
+      && command.parameters.data[0] && !systemAudioNs) {
+    systemAudioNs = now;
+  }
+  for (int la = 0; la < CECDEVICE_BROADCAST; la++) {
+    if (devices[la].present && la != command.initiator
+        && (command.destination == la
+            || command.destination == CECDEVICE_BROADCAST)) {
+      deviceReceive(la, command, now);
+    }
+  }
+  // The adapter sees all traffic, libcec hands every frame to the client
+  if (!isBridge(command.initiator)) {
+    bridgeReceive(command, now);
+  }
+}
+
+static void busLoop() {
+  unique_lock<mutex> lk(simLock);
+
+  while (!stopSim) {
+    uint64_t now = metricsNow();
+
+    // Arbitration: of the frames ready to go the lowest initiator wins
+    auto next = pending.end();
+    uint64_t wake = 0;
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+      if (it->readyNs > now) {
+        wake = (!wake || it->readyNs < wake) ? it->readyNs : wake;
+      } else if (next == pending.end()
+          || it->command.initiator < next->command.initiator) {
+        next = it;
+      }
+    }
+    if (next == pending.end()) {
+      if (wake) {
+        busCv.wait_for(lk, chrono::nanoseconds(wake - now));
+      } else {
+        busCv.wait(lk);
+      }
+      continue;
+    }
+
+    // Signal free time: 3 bit periods for a retry, 5 for a new initiator,
+    // 7 for the initiator that just sent a frame
+    uint64_t freeBits = next->retry ? 3
+        : (next->command.initiator == lastInitiator ? 7 : 5);
+    uint64_t start = busFreeNs + freeBits * CEC_BIT_NS;
+    if (start > now) {
+      busCv.wait_for(lk, chrono::nanoseconds(start - now));
+      continue;
+    }
+
+    SimFrame frame = *next;
+    pending.erase(next);
+    uint64_t duration = cecFrameNs(cecFrameSize(frame.command));
+    lk.unlock();
+    this_thread::sleep_for(chrono::nanoseconds(duration));
+    lk.lock();
+
+    now = metricsNow();
+    busFreeNs = now;
+    lastInitiator = frame.command.initiator;
+    busyNs += duration;
+    frames++;
+
+    bool ack = present(frame.command.destination);
+    (logMask & CEC_LOG_TRAFFIC)
+        && cout << "sim: " << dec << fixed << setprecision(1)
+            << sinceMs(startNs, now) << " ms " << frameString(frame.command)
+            << (ack ? "" : " nack") << endl;
+    if (!ack) {
+      nacks++;
+      if (frame.retries-- > 0) {
+        retries++;
+        frame.retry = true;
+        frame.readyNs = now;
+        pending.push_front(frame);
+        continue;
+      }
+    }
+    if (frame.waiter) {
+      frame.waiter->ok = ack;
+      frame.waiter->done = true;
+      doneCv.notify_all();
+    }
+    if (ack) {
+      deliver(frame.command, now);
+    }
+  }
+}
+
+// Kodi JSON-RPC stand-in, kodiLoop() closes the connection once the
+// bridge is gone.  simLock held.
+static void kodiSend(const string &json) {
+  if (kodiFd >= 0 && write(kodiFd, json.data(), json.size()) < 0) {
+    (logMask & CEC_LOG_DEBUG) && cout << "sim: Kodi client gone" << endl;
+  }
+}
+
+// The notification Kodi pushes for a script event, simLock held
+static void kodiEvent(const string &what, uint64_t now) {
+  const char *method;
+
+  if (what == "screensaver" || what == "wake") {
+    kodiScreensaver = what == "screensaver";
+    method = kodiScreensaver ? "GUI.OnScreensaverActivated"
+        : "GUI.OnScreensaverDeactivated";
+  } else {
+    kodiPlayer = what == "play" ? "playing"
+        : what == "pause" ? "paused" : "stopped";
+    method = what == "play" ? "Player.OnPlay"
+        : what == "pause" ? "Player.OnPause" : "Player.OnStop";
+  }
+  (logMask & CEC_LOG_TRAFFIC)
+      && cout << "sim: " << dec << fixed << setprecision(1)
+          << sinceMs(startNs, now) << " ms Kodi " << method << endl;
+  kodiSend(string("{\"jsonrpc\":\"2.0\",\"method\":\"") + method
+      + "\",\"params\":{\"data\":null,\"sender\":\"xbmc\"}}");
+}
+
+// Answers the queries the bridge sends on connect, simLock held
+static void kodiAnswer(const string &requests) {
+  size_t at = 0;
+
+  while ((at = requests.find("\"id\":", at)) != string::npos) {
+    at += 5;
+    string id = to_string(atoi(requests.c_str() + at));
+    size_t next = requests.find("\"id\":", at);
+    string request = requests.substr(at,
+        next == string::npos ? string::npos : next - at);
+    string result;
+    if (request.find("Player.GetActivePlayers") != string::npos) {
+      result = kodiPlayer == "stopped" ? "[]" : "[{\"playerid\":1,"
+          "\"playertype\":\"internal\",\"type\":\"video\"}]";
+    } else if (request.find("XBMC.GetInfoBooleans") != string::npos) {
+      result = string("{\"System.ScreenSaverActive\":")
+          + (kodiScreensaver ? "true" : "false") + "}";
+    } else {
+      continue;
+    }
+    kodiSend("{\"id\":" + id + ",\"jsonrpc\":\"2.0\",\"result\":" + result
+        + "}");
+  }
+}
+
+static void kodiLoop() {
+  char buf[1024];
+
+  while (!stopSim) {
+    struct pollfd pfd[2] = { { kodiListenFd, POLLIN, 0 },
+        { kodiFd, POLLIN, 0 } };
+    if (poll(pfd, kodiFd >= 0 ? 2 : 1, 100) <= 0) {
+      continue;
+    }
+    if (pfd[0].revents & POLLIN) {
+      int fd = accept4(kodiListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      lock_guard<mutex> lk(simLock);
+      if (fd >= 0) {
+        if (kodiFd >= 0) {
+          close(kodiFd);
+        }
+        kodiFd = fd;
+      }
+      continue;
+    }
+    ssize_t n = read(kodiFd, buf, sizeof(buf));
+    lock_guard<mutex> lk(simLock);
+    if (n <= 0) {
+      close(kodiFd);
+      kodiFd = -1;
+      continue;
+    }
+    kodiAnswer(string(buf, n));
+  }
+}
+
+static bool kodiListen() {
+  struct sockaddr_in addr;
+  int on = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kodiPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  kodiListenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (kodiListenFd < 0) {
+    return false;
+  }
+  setsockopt(kodiListenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(kodiListenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || listen(kodiListenFd, 1) < 0) {
+    cerr << "simOpen: cannot listen on Kodi port " << kodiPort << ": "
+        << strerror(errno) << endl;
+    close(kodiListenFd);
+    kodiListenFd = -1;
+    return false;
+  }
+  kodiThread = thread(kodiLoop);
+  return true;
+}
+
+static void scriptLoop() {
+  unique_lock<mutex> lk(simLock);
+
+  for (auto &e : events) {
+    uint64_t at = startNs + e.atNs;
+    while (!stopSim && metricsNow() < at) {
+      doneCv.wait_for(lk, chrono::nanoseconds(at - metricsNow()));
+    }
+    if (stopSim) {
+      return;
+    }
+    uint64_t now = metricsNow();
+
+    switch (e.type) {
+    case SIM_FRAME:
+      queueFrame(e.command, now, nullptr);
+      break;
+    case SIM_KEY: {
+      queueFrame(e.command, now, nullptr);
+      cec_command release;
+      cec_command::Format(release, e.command.initiator, e.command.destination,
+          CEC_OPCODE_USER_CONTROL_RELEASE);
+      queueFrame(release, now + uint64_t(e.holdMs) * 1000000, nullptr);
+      break;
+    }
+    case SIM_POWER:
+      devices[e.la].power = e.power;
+      break;
+    case SIM_KODI:
+      kodiEvent(e.kodi, now);
+      break;
+    case SIM_MARK:
+      markNs = now;
+      systemAudioNs = 0;
+      firstIrNs = 0;
+      firstIr.clear();
+      break;
+    case SIM_END:
+      finished = true;
+      return;
+    }
+  }
+}
+
+// Answers lircd requests after the time the IR frame would take
+static void lircLoop(SimLircd *l) {
+  char buf[1024];
+  size_t len = 0;
+
+  for (;;) {
+    ssize_t n = read(l->fds[1], buf + len, sizeof(buf) - len);
+    if (n <= 0) {
+      return;
+    }
+    len += n;
+
+    char *start = buf;
+    char *nl;
+    while ((nl = (char *) memchr(start, '\n', buf + len - start))) {
+      string line(start, nl - start);
+      start = nl + 1;
+      uint64_t now = metricsNow();
+      {
+        lock_guard<mutex> lk(simLock);
+        if (!firstIrNs) {
+          firstIrNs = now;
+          firstIr = line;
+        }
+      }
+      // Only name the socket when there is more than one
+      (logMask & CEC_LOG_TRAFFIC)
+          && cout << "sim: " << dec << fixed << setprecision(1)
+              << sinceMs(startNs, now) << " ms IR " << line
+              << (lircdCount > 1 ? " on " : "")
+              << (lircdCount > 1 ? l->path : "") << endl;
+      if (line.compare(0, 9, "SEND_ONCE") == 0) {
+        this_thread::sleep_for(chrono::milliseconds(irMs));
+      }
+      string response = "BEGIN\n" + line + "\nSUCCESS\nEND\n";
+      if (write(l->fds[1], response.data(), response.size()) < 0) {
+        return;
+      }
+    }
+    len -= start - buf;
+    memmove(buf, start, len);
+  }
+}
+
+static bool parseAddress(const string &tok, uint8_t &la) {
+  char *end;
+  unsigned long v = strtoul(tok.c_str(), &end, 16);
+  if (tok.empty() || *end || v > 15) {
+    return false;
+  }
+  la = v;
+  return true;
+}
+
+static bool parsePhysical(const string &tok, uint16_t &physical) {
+  unsigned a, b, c, d;
+  char end;
+  if (sscanf(tok.c_str(), "%x.%x.%x.%x%c", &a, &b, &c, &d, &end) != 4
+      || a > 15 || b > 15 || c > 15 || d > 15) {
+    return false;
+  }
+  physical = (a << 12) | (b << 8) | (c << 4) | d;
+  return true;
+}
+
+static bool parsePower(const string &tok, cec_power_status &power) {
+  static const struct {
+    const char *name;
+    cec_power_status power;
+  } names[] = {
+      { "on", CEC_POWER_STATUS_ON },
+      { "standby", CEC_POWER_STATUS_STANDBY },
+      { "to-on", CEC_POWER_STATUS_IN_TRANSITION_STANDBY_TO_ON },
+      { "to-standby", CEC_POWER_STATUS_IN_TRANSITION_ON_TO_STANDBY } };
+  for (auto &n : names) {
+    if (tok == n.name) {
+      power = n.power;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parseBytes(const string &tok, cec_command &command) {
+  stringstream ss(tok);
+  string byte;
+  while (getline(ss, byte, ':')) {
+    char *end;
+    unsigned long v = strtoul(byte.c_str(), &end, 16);
+    if (byte.empty() || *end || v > 0xff
+        || command.parameters.size == CEC_MAX_DATA_PACKET_SIZE) {
+      return false;
+    }
+    command.PushBack(v);
+  }
+  return true;
+}
+
+static bool parseEvent(const string &at, istringstream &ss, SimEvent &e) {
+  string what, a, b, c, d, extra;
+  char *end;
+
+  e.atNs = strtoull(at.c_str(), &end, 10) * 1000000;
+  if (*end || !(ss >> what)) {
+    return false;
+  }
+  if (what == "mark" || what == "end") {
+    e.type = what == "mark" ? SIM_MARK : SIM_END;
+    return !(ss >> extra);
+  }
+  if (what == "kodi") {
+    e.type = SIM_KODI;
+    return (ss >> e.kodi) && (e.kodi == "play" || e.kodi == "pause"
+        || e.kodi == "stop" || e.kodi == "screensaver" || e.kodi == "wake")
+        && !(ss >> extra);
+  }
+  if (what == "power") {
+    e.type = SIM_POWER;
+    return (ss >> a >> b) && parseAddress(a, e.la) && parsePower(b, e.power)
+        && !(ss >> extra);
+  }
+
+  uint8_t from, to;
+  unsigned long opcode;
+  if (what == "key") {
+    e.type = SIM_KEY;
+    if (!(ss >> a >> b >> c >> d) || !parseAddress(a, from)
+        || !parseAddress(b, to) || (ss >> extra)) {
+      return false;
+    }
+    cec_command::Format(e.command, cec_logical_address(from),
+        cec_logical_address(to), CEC_OPCODE_USER_CONTROL_PRESSED);
+    e.holdMs = strtoul(d.c_str(), &end, 10);
+    return *end == '\0' && parseBytes(c, e.command)
+        && e.command.parameters.size == 1;
+  }
+
+  e.type = SIM_FRAME;
+  if (!(ss >> a >> b) || !parseAddress(what, from) || !parseAddress(a, to)) {
+    return false;
+  }
+  opcode = strtoul(b.c_str(), &end, 16);
+  if (*end || opcode > 0xff) {
+    return false;
+  }
+  cec_command::Format(e.command, cec_logical_address(from),
+      cec_logical_address(to), cec_opcode(opcode));
+  return !(ss >> c) || (parseBytes(c, e.command) && !(ss >> extra));
+}
+
+static bool parseScript(const char *path) {
+  ifstream file(path);
+  string line;
+  unsigned lineNo = 0;
+
+  if (!file) {
+    cerr << "simOpen: cannot open " << path << endl;
+    return false;
+  }
+  while (getline(file, line)) {
+    lineNo++;
+    istringstream ss(line.substr(0, line.find('#')));
+    string first, a, b, c;
+    bool ok = true;
+    if (!(ss >> first)) {
+      continue;
+    }
+
+    if (first == "device") {
+      uint8_t la;
+      // 5 is the bridge itself
+      ok = (ss >> a >> b >> c) && parseAddress(a, la) && la < 15
+          && la != CECDEVICE_AUDIOSYSTEM;
+      if (ok) {
+        SimDevice &d = devices[la];
+        ok = parsePhysical(b, d.physical) && parsePower(c, d.power);
+        d.present = ok;
+        getline(ss >> ws, d.name);
+      }
+    } else if (first == "bridge") {
+      ok = (ss >> a) && parsePhysical(a, bridgePhysical);
+    } else if (first == "reply-ms") {
+      ok = bool(ss >> replyMs);
+    } else if (first == "ir-ms") {
+      ok = bool(ss >> irMs);
+    } else if (first == "kodi-rpc") {
+      ok = (ss >> kodiPort) && kodiPort > 0 && kodiPort < 65536;
+    } else if (isdigit(first[0])) {
+      SimEvent e;
+      ok = parseEvent(first, ss, e);
+      if (ok) {
+        events.push_back(e);
+      }
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      cerr << path << ":" << lineNo << ": invalid line: " << line << endl;
+      return false;
+    }
+  }
+  stable_sort(events.begin(), events.end(),
+      [](const SimEvent &a, const SimEvent &b) { return a.atNs < b.atNs; });
+  return true;
+}
+
+static void report() {
+  uint64_t now = metricsNow();
+
+  if (!logMask) {
+    return;
+  }
+  cout << "sim: " << dec << frames << " frames, " << nacks << " nacks, "
+      << retries << " retries, bus busy " << fixed << setprecision(1)
+      << double(busyNs) / 1000000 << " ms ("
+      << 100.0 * busyNs / (now - startNs) << "%)" << endl;
+  if (systemAudioNs) {
+    cout << "sim: <Set System Audio Mode> [On] after "
+        << sinceMs(markNs, systemAudioNs) << " ms" << endl;
+  } else {
+    cout << "sim: no <Set System Audio Mode> [On]" << endl;
+  }
+  if (firstIrNs) {
+    cout << "sim: first IR " << firstIr << " after "
+        << sinceMs(markNs, firstIrNs) << " ms" << endl;
+  } else {
+    cout << "sim: no IR sent" << endl;
+  }
+}
+
+static const char *addressNames[16] = { "TV", "Recorder 1", "Recorder 2",
+    "Tuner 1", "Playback 1", "Audio", "Tuner 2", "Tuner 3", "Playback 2",
+    "Recorder 3", "Tuner 4", "Playback 3", "Reserved 1", "Reserved 2",
+    "Free use", "Broadcast" };
+
+class SimAdapter : public CecAdapter {
+private:
+  // Frame from the bridge, blocks until it was acked or nacked
+  bool Send(const cec_command &command) {
+    unique_lock<mutex> lk(simLock);
+    SimWaiter waiter = { false, false };
+    if (stopSim) {
+      return false;
+    }
+    queueFrame(command, metricsNow(), &waiter);
+    doneCv.wait(lk, [&] { return waiter.done || stopSim; });
+    return waiter.ok;
+  }
+
+  // Request and wait for the reply like libcec does, false on a timeout
+  bool Query(cec_logical_address address, cec_opcode request,
+      cec_opcode response, uint8_t &value) {
+    SimQuery q = { address, response, false, 0 };
+    cec_command command;
+
+    {
+      lock_guard<mutex> lk(simLock);
+      queries.push_back(&q);
+    }
+    cec_command::Format(command, bridgeAudio, address, request);
+    bool ok = Send(command);
+
+    unique_lock<mutex> lk(simLock);
+    if (ok) {
+      doneCv.wait_for(lk, chrono::milliseconds(SIM_QUERY_MS),
+          [&] { return q.done || stopSim; });
+    }
+    queries.erase(find(queries.begin(), queries.end(), &q));
+    value = q.value;
+    return q.done;
+  }
+
+  bool Forward(cec_logical_address address, cec_opcode opcode, int param) {
+    cec_command command;
+    cec_command::Format(command, bridgeAudio, address, opcode);
+    if (param >= 0) {
+      command.PushBack(param);
+    }
+    return Send(command);
+  }
+
+public:
+  bool Transmit(const cec_command &command) {
+    return Send(command);
+  }
+
+  bool AudioEnable(bool enable) {
+    return Forward(CECDEVICE_BROADCAST, CEC_OPCODE_SET_SYSTEM_AUDIO_MODE,
+        enable ? 1 : 0);
+  }
+
+  bool PowerOnDevices(cec_logical_address address) {
+    if (isBridge(address)) {
+      return true;
+    }
+    if (address == CECDEVICE_TV) {
+      return Forward(address, CEC_OPCODE_IMAGE_VIEW_ON, -1);
+    }
+    // Power On Function
+    return Forward(address, CEC_OPCODE_USER_CONTROL_PRESSED, 0x6d)
+        && Forward(address, CEC_OPCODE_USER_CONTROL_RELEASE, -1);
+  }
+
+  bool StandbyDevices(cec_logical_address address) {
+    if (isBridge(address)) {
+      return true;
+    }
+    return Forward(address, CEC_OPCODE_STANDBY, -1);
+  }
+
+  cec_power_status GetDevicePowerStatus(cec_logical_address address) {
+    uint8_t power;
+    if (isBridge(address)) {
+      return CEC_POWER_STATUS_ON;
+    }
+    if (!Query(address, CEC_OPCODE_GIVE_DEVICE_POWER_STATUS,
+        CEC_OPCODE_REPORT_POWER_STATUS, power)) {
+      return CEC_POWER_STATUS_UNKNOWN;
+    }
+    return cec_power_status(power);
+  }
+
+  cec_version GetDeviceCecVersion(cec_logical_address address) {
+    uint8_t version;
+    if (isBridge(address)) {
+      return CEC_VERSION_1_3A;
+    }
+    if (!Query(address, CEC_OPCODE_GET_CEC_VERSION, CEC_OPCODE_CEC_VERSION,
+        version)) {
+      return CEC_VERSION_UNKNOWN;
+    }
+    return cec_version(version);
+  }
+
+  uint16_t GetDevicePhysicalAddress(cec_logical_address address) {
+    if (isBridge(address)) {
+      return bridgePhysical;
+    }
+    return address >= 0 && address < CECDEVICE_BROADCAST
+        && devices[address].present ? devices[address].physical : 0xffff;
+  }
+
+  const char *ToString(const cec_logical_address address) {
+    return address >= 0 && address < 16 ? addressNames[address] : "unknown";
+  }
+
+  const char *ToString(const cec_power_status status) {
+    switch (status) {
+    case CEC_POWER_STATUS_ON:
+      return "on";
+    case CEC_POWER_STATUS_STANDBY:
+      return "standby";
+    case CEC_POWER_STATUS_IN_TRANSITION_STANDBY_TO_ON:
+      return "in transition from standby to on";
+    case CEC_POWER_STATUS_IN_TRANSITION_ON_TO_STANDBY:
+      return "in transition from on to standby";
+    default:
+      return "unknown";
+    }
+  }
+
+  void Close() {
+    {
+      lock_guard<mutex> lk(simLock);
+      stopSim = true;
+      busCv.notify_all();
+      doneCv.notify_all();
+    }
+    busThread.join();
+    scriptThread.join();
+    if (kodiThread.joinable()) {
+      kodiThread.join();
+      close(kodiListenFd);
+      if (kodiFd >= 0) {
+        close(kodiFd);
+      }
+      kodiListenFd = kodiFd = -1;
+    }
+    report();
+  }
+};
+
+static SimAdapter adapter;
+
+CecAdapter *simOpen(const char *script, ICECCallbacks *cb, void *cbParam) {
+  if (!parseScript(script)) {
+    return nullptr;
+  }
+  // The bridge takes the first free playback address like libcec
+  static const cec_logical_address playback[] = { CECDEVICE_PLAYBACKDEVICE1,
+      CECDEVICE_PLAYBACKDEVICE2, CECDEVICE_PLAYBACKDEVICE3 };
+  bridgePlayback = CECDEVICE_UNKNOWN;
+  for (auto la : playback) {
+    if (!devices[la].present) {
+      bridgePlayback = la;
+      break;
+    }
+  }
+
+  if (kodiPort && !kodiListen()) {
+    return nullptr;
+  }
+
+  callbacks = cb;
+  callbackParam = cbParam;
+  startNs = markNs = metricsNow();
+  busThread = thread(busLoop);
+  scriptThread = thread(scriptLoop);
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "simOpen: " << events.size() << " events, bridge at "
+          << bridgeAudio << " and " << bridgePlayback << endl;
+  return &adapter;
+}
+
+void simLircdClose() {
+  for (unsigned i = 0; i < lircdCount; i++) {
+    SimLircd &l = lircds[i];
+    if (l.worker.joinable()) {
+      shutdown(l.fds[1], SHUT_RDWR);
+      l.worker.join();
+      close(l.fds[1]);
+    }
+  }
+}
+
+int simLircd(const char *path, unsigned sendOnceMs) {
+  if (lircdCount == PROFILES_MAX) {
+    return -1;
+  }
+  SimLircd &l = lircds[lircdCount];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, l.fds) < 0) {
+    cerr << "simLircd: socketpair " << strerror(errno) << endl;
+    return -1;
+  }
+  l.path = path;
+  irMs = sendOnceMs;
+  l.worker = thread(lircLoop, &l);
+  // Early exits from main() must not destroy a joinable thread
+  if (lircdCount++ == 0) {
+    atexit(simLircdClose);
+  }
+  return l.fds[0];
+}
+
+bool simFinished() {
+  return finished;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "libcec/cec.h"
+#include "cecadapter.h"
+
+// Simulated CEC bus for measuring handshakes without hardware.  The bus
+// carries frames with real CEC timing (start bit, 2.4 ms bits, signal free
+// time, arbitration by initiator address, acks and one retry on a nack)
+// between the bridge and scripted virtual devices, and a fake lircd takes
+// the IR sends.  The bridge handlers run unchanged on top of it.
+//
+// Script lines, '#' starts a comment:
+//
+//   device <la> <physical a.b.c.d> <on|standby> [name]
+//   bridge <physical a.b.c.d>       physical address of the bridge
+//   reply-ms <ms>                   device response time (default 30)
+//   ir-ms <ms>                      lircd SEND_ONCE duration (default 70)
+//   kodi-rpc <port>                 serve Kodi's JSON-RPC on localhost
+//   <ms> <from> <to> <opcode> [xx:xx...]   frame sent by a virtual device
+//   <ms> power <la> <on|standby|to-on|to-standby>
+//   <ms> key <from> <to> <keycode> <hold ms>  key press and release
+//   <ms> kodi <play|pause|stop|screensaver|wake>  Kodi notification
+//   <ms> mark                       reset the time-to-audio reference
+//   <ms> end                        stop the bridge
+//
+// Times are ms from the start of the script, addresses hex (f broadcast).
+// Virtual devices answer power status, physical address and CEC version
+// requests, follow <Standby>, <Image View On> and power keys, and the
+// device whose address is selected by <Set Stream Path> becomes active.
+
+// Parse the script and start the bus, null on a script error.  callbacks
+// receive the traffic for the bridge as libcec would deliver it.
+CecAdapter *simOpen(const char *script, CEC::ICECCallbacks *callbacks,
+    void *cbParam);
+
+#define SIM_IR_MS 70
+
+// lircd stand-in for the socket at path, returns the fd to use instead of
+// lirc_get_local_socket().  SEND_ONCE takes sendOnceMs unless the script
+// sets ir-ms.
+int simLircd(const char *path, unsigned sendOnceMs);
+// After the last IR send, once the transmitters closed their fds
+void simLircdClose();
+
+// The script reached its "end" event
+bool simFinished();
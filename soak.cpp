@@ -0,0 +1,342 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <malloc.h>
+
+#include "alloccheck.h"
+#include "cec-lirc.h"
+#include "dedupe.h"
+#include "dispatch.h"
+#include "metrics.h"
+#include "soak.h"
+
+using namespace std;
+using namespace CEC;
+
+// One cycle of the event mix: "key <keycode> <duration ms>" (0 is the
+// press), "source <la> <activated>" or a frame "<from> <to> <opcode>
+// [xx:xx...]" as in the simbus.h scripts
+static const char *const mix[] = {
+  // volume taps and a hold, mute, Kodi navigation
+  "key 41 0", "key 41 120", "key 42 0", "key 42 900", "key 43 0",
+  "key 43 80", "key 01 0", "key 01 90", "key 00 0", "key 00 90",
+  "key 0d 0", "key 0d 90", "key 71 0", "key 71 90",
+  // requests answered from the amp models and the power sync
+  "0 5 71", "0 5 a4 0a", "0 5 a4 01:0a:0f", "0 5 8f",
+  // system audio and amp power on and off
+  "0 5 70 20:00", "0 5 70", "0 5 90 00", "0 5 90 01", "0 f 36",
+  // the TV wakes up and routes away from and back to the bridge
+  "4 0 04", "4 f 82 10:00", "0 f 80 10:00:20:00", "0 f 86 20:00",
+  "source 4 1", "source 5 1",
+};
+
+#define MIX_SIZE (sizeof(mix) / sizeof(mix[0]))
+
+// The deactivation arms a 250 ms timer, keep the timer slots to a few
+#define SOURCE_LOST_EVENTS 4096
+
+enum SoakType { SOAK_KEY, SOAK_COMMAND, SOAK_SOURCE };
+
+struct SoakEvent {
+  SoakType type;
+  cec_keypress key;
+  cec_command command;
+  cec_logical_address la;
+  uint8_t activated;
+};
+
+struct SoakSample {
+  long rssKb;
+  int fds;
+  long heapKb;
+  uint64_t latencyNs;   // mean over the interval
+};
+
+static SoakEvent events[MIX_SIZE];
+static ICECCallbacks *callbacks = nullptr;
+static void *callbackParam = nullptr;
+static uint64_t total = 0;
+static thread driver;
+static atomic<bool> stopSoak(false);
+static atomic<bool> finished(false);
+static atomic<bool> passed(true);
+
+// Latency probe, written by the dispatch thread
+static uint64_t probeSentNs = 0;
+static atomic<uint64_t> probeRanNs(0);
+
+static atomic<unsigned> frames(0);
+
+class SoakAdapter : public CecAdapter {
+public:
+  bool Transmit(const cec_command &command) {
+    frames++;
+    return true;
+  }
+  bool AudioEnable(bool enable) {
+    return true;
+  }
+  bool PowerOnDevices(cec_logical_address address) {
+    return true;
+  }
+  bool StandbyDevices(cec_logical_address address) {
+    return true;
+  }
+  cec_power_status GetDevicePowerStatus(cec_logical_address address) {
+    return CEC_POWER_STATUS_ON;
+  }
+  cec_version GetDeviceCecVersion(cec_logical_address address) {
+    return CEC_VERSION_1_4;
+  }
+  // TV at 0.0.0.0, the bridge at 2.0.0.0, the others at 1.0.0.0
+  uint16_t GetDevicePhysicalAddress(cec_logical_address address) {
+    switch (address) {
+    case CECDEVICE_TV:
+      return 0x0000;
+    case CECDEVICE_AUDIOSYSTEM:
+      return 0x2000;
+    default:
+      return 0x1000;
+    }
+  }
+  const char *ToString(const cec_logical_address address) {
+    return "soak device";
+  }
+  const char *ToString(const cec_power_status status) {
+    return "on";
+  }
+  void Close() {
+    cout << "soak: " << frames << " CEC frames sent" << endl;
+  }
+};
+
+static SoakAdapter adapter;
+
+static bool parseEvent(const char *text, SoakEvent &e) {
+  unsigned a, b, opcode;
+  int n;
+
+  if (sscanf(text, "key %x %u%n", &a, &b, &n) == 2 && !text[n]) {
+    e.type = SOAK_KEY;
+    e.key.keycode = cec_user_control_code(a);
+    e.key.duration = b;
+    return true;
+  }
+  if (sscanf(text, "source %x %u%n", &a, &b, &n) == 2 && !text[n]) {
+    e.type = SOAK_SOURCE;
+    e.la = cec_logical_address(a);
+    e.activated = b;
+    return true;
+  }
+  if (sscanf(text, "%x %x %x%n", &a, &b, &opcode, &n) != 3) {
+    return false;
+  }
+  e.type = SOAK_COMMAND;
+  cec_command::Format(e.command, cec_logical_address(a),
+      cec_logical_address(b), cec_opcode(opcode));
+  for (const char *p = text + n; *p;) {
+    char *end;
+    unsigned long byte = strtoul(p, &end, 16);
+    if (end == p || byte > 0xff || (*end && *end != ':')) {
+      return false;
+    }
+    e.command.PushBack(byte);
+    p = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+static void inject(const SoakEvent &e) {
+  switch (e.type) {
+  case SOAK_KEY:
+    callbacks->keyPress(callbackParam, &e.key);
+    break;
+  case SOAK_COMMAND:
+    callbacks->commandReceived(callbackParam, &e.command);
+    break;
+  case SOAK_SOURCE:
+    callbacks->sourceActivated(callbackParam, e.la, e.activated);
+    break;
+  }
+}
+
+static void probe(void *arg) {
+  probeRanNs.store(metricsNow(), memory_order_release);
+}
+
+// Time for everything queued before the probe to be handled, 0 if stopped
+static uint64_t waitProbe() {
+  probeRanNs = 0;
+  probeSentNs = metricsNow();
+  while (!dispatchCall(probe, nullptr)) {
+    if (stopSoak) {
+      return 0;
+    }
+    this_thread::yield();
+  }
+  uint64_t ran;
+  while (!(ran = probeRanNs.load(memory_order_acquire))) {
+    if (stopSoak) {
+      return 0;
+    }
+    this_thread::yield();
+  }
+  return ran - probeSentNs;
+}
+
+static long rssKb() {
+  long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (!f) {
+    return -1;
+  }
+  bool ok = fscanf(f, "%ld %ld", &size, &resident) == 2;
+  fclose(f);
+  return ok ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+static int openFds() {
+  DIR *dir = opendir("/proc/self/fd");
+  int n = 0;
+
+  if (!dir) {
+    return -1;
+  }
+  while (readdir(dir)) {
+    n++;
+  }
+  closedir(dir);
+  // ".", ".." and the directory itself
+  return n - 3;
+}
+
+static long heapKb() {
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+  return mallinfo2().uordblks / 1024;
+#else
+  // Older Raspbian and OSMC images, the int counters wrap at 2 GB
+  return long(unsigned(mallinfo().uordblks)) / 1024;
+#endif
+#else
+  return -1;
+#endif
+}
+
+static void check(const char *what, uint64_t value, uint64_t limit) {
+  if (value > limit) {
+    cerr << "soak: " << what << " " << value << " exceeds " << limit << endl;
+    passed = false;
+  }
+}
+
+static void soakLoop() {
+  // Samples are taken at a probe
+  uint64_t interval = total / SOAK_SAMPLES / SOAK_PROBE_EVENTS
+      * SOAK_PROBE_EVENTS;
+  uint64_t latencySum = 0;
+  uint64_t latencyMax = 0;
+  unsigned probes = 0;
+  SoakSample base = {};
+  unsigned sample = 0;
+  SoakEvent sourceLost = {};
+
+  sourceLost.type = SOAK_SOURCE;
+  sourceLost.la = CECDEVICE_AUDIOSYSTEM;
+  sourceLost.activated = 0;
+
+  for (uint64_t sent = 1; sent <= total && !stopSoak; sent++) {
+    inject(events[sent % MIX_SIZE]);
+    if (sent % SOURCE_LOST_EVENTS == 0) {
+      inject(sourceLost);
+    }
+    if (sent % SOAK_PROBE_EVENTS && sent != total) {
+      continue;
+    }
+    uint64_t latency = waitProbe();
+    latencySum += latency;
+    latencyMax = max(latencyMax, latency);
+    probes++;
+    if (sent % interval && sent != total) {
+      continue;
+    }
+
+    SoakSample s = { rssKb(), openFds(), heapKb(), latencySum / probes };
+    cout << "soak: " << sent << " events, rss " << s.rssKb << " kB, "
+        << s.fds << " fds, heap " << s.heapKb << " kB, latency "
+        << fixed << setprecision(1) << double(s.latencyNs) / 1000
+        << " us (max " << double(latencyMax) / 1000 << " us)" << endl;
+    latencySum = latencyMax = 0;
+    probes = 0;
+
+    // Caches, the allocator arenas and the flight recorder fill up first
+    if (++sample == SOAK_WARMUP_SAMPLES) {
+      base = s;
+      allocCheckArm();
+    } else if (sample > SOAK_WARMUP_SAMPLES) {
+      check("rss kB", s.rssKb, base.rssKb + SOAK_RSS_SLACK_KB);
+      check("open fds", s.fds, base.fds + SOAK_FD_SLACK);
+      check("heap kB", s.heapKb, base.heapKb + SOAK_HEAP_SLACK_KB);
+      check("latency ns", s.latencyNs, max<uint64_t>(SOAK_LATENCY_FACTOR
+          * base.latencyNs, SOAK_LATENCY_FLOOR_NS));
+    }
+  }
+  if (!stopSoak) {
+    check("allocations", allocCheckReport(), 0);
+    cout << "soak: " << (passed ? "passed" : "FAILED") << endl;
+  }
+  finished = true;
+}
+
+CecAdapter *soakOpen(ICECCallbacks *cb, void *cbParam) {
+  for (unsigned i = 0; i < MIX_SIZE; i++) {
+    if (!parseEvent(mix[i], events[i])) {
+      cerr << "soakOpen: invalid event " << mix[i] << endl;
+      return nullptr;
+    }
+  }
+  // The mix repeats within microseconds, nearly every event would be
+  // dropped as a duplicate.  The events still go through the check.
+  for (int c = 0; c < DEDUPE_CLASSES; c++) {
+    dedupeWindow(DedupeClass(c), 0);
+  }
+  callbacks = cb;
+  callbackParam = cbParam;
+  return &adapter;
+}
+
+void soakStop() {
+  stopSoak = true;
+  if (driver.joinable()) {
+    driver.join();
+  }
+}
+
+bool soakStart(uint64_t count) {
+  if (count < SOAK_SAMPLES * SOAK_PROBE_EVENTS) {
+    cerr << "soak: at least " << SOAK_SAMPLES * SOAK_PROBE_EVENTS
+        << " events" << endl;
+    return false;
+  }
+  total = count;
+  driver = thread(soakLoop);
+  // Early exits from main() must not destroy a joinable thread
+  atexit(soakStop);
+  return true;
+}
+
+bool soakFinished() {
+  return finished;
+}
+
+bool soakPassed() {
+  return passed;
+}
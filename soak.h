@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+#include "cecadapter.h"
+
+// Soak test.  A driver thread feeds a fixed mix of key presses, commands
+// and source changes through the libcec callbacks, as libcec would, to
+// handlers running against local stand-ins: an adapter that acks every
+// frame at once and reports every device on, the simbus.h lircd and Kodi's
+// EventServer port on localhost.  Every SOAK_PROBE_EVENTS events a probe
+// measures the dispatch latency, which also keeps the dispatch ring from
+// overflowing.  RSS, open fds and heap in use are sampled SOAK_SAMPLES
+// times; once the first SOAK_WARMUP_SAMPLES are past, growth beyond the
+// slack below (or a mean latency above SOAK_LATENCY_FACTOR times the
+// baseline) fails the run.
+
+#define SOAK_SAMPLES          20
+#define SOAK_WARMUP_SAMPLES   2
+#define SOAK_PROBE_EVENTS     64
+#define SOAK_RSS_SLACK_KB     512
+#define SOAK_HEAP_SLACK_KB    64
+#define SOAK_FD_SLACK         0
+#define SOAK_LATENCY_FACTOR   2
+// Latencies below this never fail, the scheduler's noise floor
+#define SOAK_LATENCY_FLOOR_NS 200000
+
+// The stand-in adapter, callbacks receive the events like from libcec
+CecAdapter *soakOpen(CEC::ICECCallbacks *callbacks, void *cbParam);
+// Start driving events once the dispatch thread and the transmit queue run
+bool soakStart(uint64_t events);
+void soakStop();
+
+// All events were sent and the last sample taken
+bool soakFinished();
+// No threshold was exceeded
+bool soakPassed();
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <string>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cec-lirc.h"
+#include "bridgestate.h"
+#include "statefile.h"
+
+using namespace std;
+using namespace CEC;
+
+static string filePath;
+static string tmpPath;
+static StateFileRecord lastSaved;
+
+static uint64_t realtimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t checksum(StateFileRecord record) {
+  const uint8_t *p = (const uint8_t *) &record;
+  uint32_t hash = 2166136261u;
+
+  record.checksum = 0;
+  for (size_t i = 0; i < sizeof(record); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// The persistent part of the live state, savedNs left 0 so records can be
+// compared
+static bool capture(StateFileRecord &record) {
+  BridgeState s;
+
+  if (!stateSnapshot(s)) {
+    return false;
+  }
+  memset(&record, 0, sizeof(record));
+  memcpy(record.magic, STATE_FILE_MAGIC, sizeof(record.magic));
+  record.size = sizeof(record);
+  record.ampOn = s.ampOn;
+  record.systemAudio = s.systemAudio;
+  record.activeSource = s.activeSource;
+  record.volume = s.volume;
+  record.activePath = s.activePath;
+  record.mute = s.mute;
+  memcpy(record.power, s.power, sizeof(record.power));
+  return true;
+}
+
+static bool save(const StateFileRecord &state, bool sync) {
+  StateFileRecord record = state;
+  record.savedNs = realtimeNs();
+  record.checksum = checksum(record);
+
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644);
+  if (fd < 0) {
+    cerr << "stateFile: open " << tmpPath << ": " << strerror(errno) << endl;
+    return false;
+  }
+  bool ok = write(fd, &record, sizeof(record)) == sizeof(record)
+      && (!sync || fdatasync(fd) == 0);
+  close(fd);
+  if (!ok || rename(tmpPath.c_str(), filePath.c_str()) < 0) {
+    cerr << "stateFile: save " << filePath << ": " << strerror(errno) << endl;
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool stateFileLoad(const char *path, unsigned maxAgeS) {
+  StateFileRecord record;
+  bool restored = false;
+
+  filePath = path;
+  tmpPath = filePath + ".tmp";
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    ssize_t n = read(fd, &record, sizeof(record));
+    close(fd);
+    uint64_t now = realtimeNs();
+    if (n != sizeof(record) || memcmp(record.magic, STATE_FILE_MAGIC,
+        sizeof(record.magic)) || record.size != sizeof(record)
+        || record.checksum != checksum(record)) {
+      cerr << "stateFile: ignoring invalid " << path << endl;
+    } else if (record.savedNs > now
+        || now - record.savedNs > uint64_t(maxAgeS) * 1000000000ull) {
+      (logMask & CEC_LOG_DEBUG)
+          && cout << "stateFile: " << path << " too old" << endl;
+    } else {
+      BridgeState saved;
+      saved.ampOn = record.ampOn;
+      saved.systemAudio = record.systemAudio;
+      saved.activeSource = record.activeSource;
+      saved.activePath = record.activePath;
+      saved.volume = record.volume;
+      saved.mute = record.mute;
+      memcpy(saved.power, record.power, sizeof(saved.power));
+      stateRestore(saved);
+      restored = true;
+      (logMask & CEC_LOG_DEBUG)
+          && cout << "stateFile: restored " << path << ", "
+              << (now - record.savedNs) / 1000000000ull << " s old" << endl;
+    }
+  }
+
+  // Anything unchanged from the restored state needs no save
+  if (!capture(lastSaved)) {
+    memset(&lastSaved, 0, sizeof(lastSaved));
+  }
+  return restored;
+}
+
+void stateFileUpdate() {
+  StateFileRecord record;
+
+  if (filePath.empty() || !capture(record)
+      || !memcmp(&record, &lastSaved, sizeof(record))) {
+    return;
+  }
+  // A failed save is retried on the next change, not every loop
+  save(record, false);
+  lastSaved = record;
+}
+
+void stateFileClose() {
+  StateFileRecord record;
+
+  if (filePath.empty() || !capture(record)) {
+    return;
+  }
+  save(record, true);
+  filePath.clear();
+}
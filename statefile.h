@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bridge state kept across restarts.  The amp power, volume and mute
+// estimate, system audio mode, active route and the power status of every
+// logical address are saved to a small binary file whenever they change
+// and on shutdown, and restored at startup so the first decisions are not
+// made blind.  A snapshot older than the maximum age is ignored.
+//
+// The file is written to FILE.tmp and renamed over FILE, so a reader sees
+// either the old or the new snapshot.  Only the shutdown save is synced to
+// disk, a snapshot torn by a power cut fails its checksum and is ignored.
+
+#define STATE_FILE_PATH    "/var/tmp/cec-lirc.state"
+#define STATE_FILE_MAGIC   "CECSTAT1"
+#define STATE_FILE_MAX_AGE 600    // seconds
+
+struct StateFileRecord {
+  char     magic[8];
+  uint32_t size;          // sizeof(StateFileRecord)
+  uint32_t checksum;      // FNV-1a of the record with checksum 0
+  uint64_t savedNs;       // CLOCK_REALTIME
+  uint8_t  ampOn;         // BridgeState fields, BRIDGE_UNKNOWN if unknown
+  uint8_t  systemAudio;
+  uint8_t  activeSource;
+  uint8_t  volume;
+  uint16_t activePath;
+  uint8_t  mute;
+  uint8_t  reserved;
+  uint8_t  power[16];
+};
+
+static_assert(sizeof(StateFileRecord) == 48, "StateFileRecord layout");
+
+// Restore the snapshot in path into the bridge state (bridgestate.h) if it
+// is at most maxAgeS seconds old, then keep path up to date.  False when
+// there was nothing to restore.
+bool stateFileLoad(const char *path, unsigned maxAgeS);
+
+// Save if the state changed since the last save, called from the main loop
+void stateFileUpdate();
+
+// Final save, synced to disk
+void stateFileClose();
@@ -0,0 +1,146 @@
+#include <iostream>
+#include <atomic>
+
+#include "cec-lirc.h"
+#include "cecsched.h"
+#include "metrics.h"
+#include "topology.h"
+
+using namespace std;
+using namespace CEC;
+
+struct TopologyEntry {
+  uint16_t physical;
+  uint64_t learntNs;      // 0 never
+  uint64_t requestedNs;   // last <Give Physical Address>
+};
+
+static TopologyEntry entries[CECDEVICE_BROADCAST];
+static atomic<uint16_t> self(TOPOLOGY_UNKNOWN);
+static uint16_t activePath = TOPOLOGY_UNKNOWN;
+
+static const uint64_t maxAgeNs = TOPOLOGY_MAX_AGE_S * 1000000000ull;
+
+static uint16_t physicalAt(const cec_command *command, unsigned offset) {
+  if (command->parameters.size < offset + 2) {
+    return TOPOLOGY_UNKNOWN;
+  }
+  return (command->parameters.data[offset] << 8)
+      | command->parameters.data[offset + 1];
+}
+
+// Mask of the significant nibbles, 0.0.0.0 is the root and matches all
+static uint16_t depthMask(uint16_t physical) {
+  uint16_t mask = 0;
+  for (int shift = 12; shift >= 0 && (physical >> shift) & 0xf; shift -= 4) {
+    mask |= 0xf << shift;
+  }
+  return mask;
+}
+
+static bool ancestorOf(uint16_t above, uint16_t below) {
+  return (below & depthMask(above)) == above;
+}
+
+static void learn(cec_logical_address address, uint16_t physical) {
+  if (address >= CECDEVICE_BROADCAST || physical == TOPOLOGY_UNKNOWN) {
+    return;
+  }
+  TopologyEntry &e = entries[address];
+  if (e.physical != physical) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "topology: " << dec << address << " at " << hex
+            << (physical >> 12) << "." << ((physical >> 8) & 0xf) << "."
+            << ((physical >> 4) & 0xf) << "." << (physical & 0xf) << dec
+            << '\n';
+  }
+  e.physical = physical;
+  e.learntNs = metricsNow();
+}
+
+void topologyInit() {
+  for (auto &e : entries) {
+    e.physical = TOPOLOGY_UNKNOWN;
+    e.learntNs = 0;
+    e.requestedNs = 0;
+  }
+  activePath = TOPOLOGY_UNKNOWN;
+}
+
+void topologySetSelf(uint16_t physical) {
+  self = physical;
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "topology: bridge at " << hex << physical << dec << endl;
+}
+
+uint16_t topologyRouteOf(const cec_command *command) {
+  switch (command->opcode) {
+  case CEC_OPCODE_ROUTING_CHANGE:
+    // original address, new address
+    return physicalAt(command, 2);
+  case CEC_OPCODE_ROUTING_INFORMATION:
+  case CEC_OPCODE_SET_STREAM_PATH:
+  case CEC_OPCODE_ACTIVE_SOURCE:
+    return physicalAt(command, 0);
+  default:
+    return TOPOLOGY_UNKNOWN;
+  }
+}
+
+void topologyCommand(const cec_command *command) {
+  switch (command->opcode) {
+  case CEC_OPCODE_REPORT_PHYSICAL_ADDRESS:
+  case CEC_OPCODE_INACTIVE_SOURCE:
+    learn(command->initiator, physicalAt(command, 0));
+    break;
+  case CEC_OPCODE_ACTIVE_SOURCE:
+    learn(command->initiator, physicalAt(command, 0));
+    activePath = physicalAt(command, 0);
+    break;
+  case CEC_OPCODE_ROUTING_CHANGE:
+  case CEC_OPCODE_ROUTING_INFORMATION:
+  case CEC_OPCODE_SET_STREAM_PATH:
+    if (topologyRouteOf(command) != TOPOLOGY_UNKNOWN) {
+      activePath = topologyRouteOf(command);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+uint16_t topologyPhysical(cec_logical_address address) {
+  if (address >= CECDEVICE_BROADCAST) {
+    return TOPOLOGY_UNKNOWN;
+  }
+  TopologyEntry &e = entries[address];
+  uint64_t now = metricsNow();
+  // Ask again at most once per max age, the report arrives as a command
+  if ((!e.learntNs || now - e.learntNs > maxAgeNs)
+      && (!e.requestedNs || now - e.requestedNs > maxAgeNs)) {
+    cec_command request;
+    cec_command::Format(request, CECDEVICE_AUDIOSYSTEM, address,
+        CEC_OPCODE_GIVE_PHYSICAL_ADDRESS);
+    cecQueueTransmit(request, CEC_PRIO_QUERY, "GIVE_PHYSICAL_ADDRESS");
+    e.requestedNs = now;
+  }
+  return e.physical;
+}
+
+uint16_t topologyActivePath() {
+  return activePath;
+}
+
+bool topologyOnOurBranch(uint16_t physical) {
+  uint16_t us = self;
+  if (us == TOPOLOGY_UNKNOWN || physical == TOPOLOGY_UNKNOWN) {
+    return true;
+  }
+  return ancestorOf(physical, us) || ancestorOf(us, physical);
+}
+
+bool topologyRoutedToUs(uint16_t physical) {
+  uint16_t us = self;
+  return us != TOPOLOGY_UNKNOWN && physical != TOPOLOGY_UNKNOWN
+      && ancestorOf(us, physical);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libcec/cec.h"
+
+// HDMI topology cache.  The physical address of every logical address is
+// learnt from <Report Physical Address>, <Active Source> and <Inactive
+// Source>, the active route from the routing messages, so handlers can
+// tell in O(1) whether an event concerns the bridge's branch of the HDMI
+// tree without querying the bus.  Entries older than TOPOLOGY_MAX_AGE_S
+// are refreshed lazily: looking one up queues a <Give Physical Address>
+// at query priority and answers from the cache meanwhile.
+//
+// Only to be used from the dispatch thread.
+
+#define TOPOLOGY_UNKNOWN   0xffff
+#define TOPOLOGY_MAX_AGE_S 600
+
+// Before the dispatch thread starts
+void topologyInit();
+// The bridge's own physical address once the adapter is open, any thread
+void topologySetSelf(uint16_t physical);
+
+// Learn from a received command
+void topologyCommand(const CEC::cec_command *command);
+
+uint16_t topologyPhysical(CEC::cec_logical_address address);
+
+// Physical address the TV routes to, TOPOLOGY_UNKNOWN until seen
+uint16_t topologyActivePath();
+
+// The route to physical passes through the bridge or ends above it (TV
+// inputs the bridge hangs off), true while either address is unknown
+bool topologyOnOurBranch(uint16_t physical);
+
+// The route to physical ends at the bridge or a device behind it, false
+// while either address is unknown
+bool topologyRoutedToUs(uint16_t physical);
+
+// The route a routing or source message switches to, TOPOLOGY_UNKNOWN
+// for other messages
+uint16_t topologyRouteOf(const CEC::cec_command *command);
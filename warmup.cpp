@@ -0,0 +1,133 @@
+#include <iostream>
+
+#include "cec-lirc.h"
+#include "bridgestate.h"
+#include "cecsched.h"
+#include "dispatch.h"
+#include "flightrec.h"
+#include "irsched.h"
+#include "metrics.h"
+#include "warmup.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+static int ampDevice = -1;
+static uint64_t windowNs = 0;
+static int rollbackTimer = -1;
+// The rollback is waiting for the TV's power status
+static bool rollbackAsked = false;
+// Last IR power-on and power-off, 0 after the other one
+static uint64_t poweredNs = 0;
+static uint64_t offNs = 0;
+
+static void cancelRollback() {
+  if (rollbackTimer >= 0) {
+    dispatchCancel(rollbackTimer);
+    rollbackTimer = -1;
+  }
+  rollbackAsked = false;
+}
+
+static void rollbackAnswer(cec_logical_address address,
+    cec_power_status tv) {
+  WatchdogScope scope("warm-up rollback");
+
+  // An audio on or off meanwhile took over
+  if (!rollbackAsked) {
+    return;
+  }
+  rollbackAsked = false;
+  if (tv != CEC_POWER_STATUS_UNKNOWN) {
+    statePower(CECDEVICE_TV, tv);
+  }
+  if (tv == CEC_POWER_STATUS_ON) {
+    (logMask & CEC_LOG_DEBUG) && cout << "warmup: TV is on, keep amp" << '\n';
+    flightRecAction(FR_ACTION_WARM_UP, true, "kept");
+    return;
+  }
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "warmup: TV did not power on, rolling back" << '\n';
+  flightRecAction(FR_ACTION_WARM_UP, irSendKey(ampDevice, IR_POWER_OFF),
+      "rollback");
+  poweredNs = 0;
+  offNs = metricsNow();
+}
+
+static void rollback(void *arg) {
+  rollbackTimer = -1;
+  rollbackAsked = true;
+
+  // The report may have been missed, ask before switching the amp off
+  BridgeState s;
+  cec_power_status tv = CEC_POWER_STATUS_UNKNOWN;
+  if (stateSnapshot(s)) {
+    tv = cec_power_status(s.power[CECDEVICE_TV]);
+  }
+  if (tv == CEC_POWER_STATUS_ON
+      || !cecQueuePowerStatus(CECDEVICE_TV, rollbackAnswer)) {
+    rollbackAnswer(CECDEVICE_TV, tv);
+  }
+}
+
+void warmupInit(int device, unsigned windowMs) {
+  ampDevice = device;
+  windowNs = uint64_t(windowMs) * 1000000;
+}
+
+void warmupStart(const char *reason) {
+  BridgeState s;
+
+  if (!windowNs || rollbackTimer >= 0 || rollbackAsked) {
+    return;
+  }
+  // Nothing to predict when the TV is on already or the amp is powered
+  if (stateSnapshot(s) && (s.ampOn == 1
+      || s.power[CECDEVICE_TV] == CEC_POWER_STATUS_ON)) {
+    return;
+  }
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "warmup: " << reason << ", IR power on" << '\n';
+  bool ok = irSendKey(ampDevice, IR_POWER_ON);
+  flightRecAction(FR_ACTION_WARM_UP, ok, reason);
+  if (!ok) {
+    return;
+  }
+  poweredNs = metricsNow();
+  offNs = 0;
+  rollbackTimer = dispatchTimer(windowNs, rollback, nullptr);
+}
+
+void warmupAudioOn() {
+  uint64_t now = metricsNow();
+
+  cancelRollback();
+  if (poweredNs && now - poweredNs < windowNs) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "warmup: amp powered " << (now - poweredNs) / 1000000
+            << " ms ago, no IR power on" << '\n';
+    return;
+  }
+  irSendKey(ampDevice, IR_POWER_ON);
+  poweredNs = now;
+  offNs = 0;
+}
+
+void warmupAudioOff() {
+  uint64_t now = metricsNow();
+
+  cancelRollback();
+  // The standby report the rollback asked for ends up here as well
+  if (offNs && now - offNs < windowNs) {
+    (logMask & CEC_LOG_DEBUG)
+        && cout << "warmup: amp switched off " << (now - offNs) / 1000000
+            << " ms ago, no IR power off" << '\n';
+    return;
+  }
+  irSendKey(ampDevice, IR_POWER_OFF);
+  poweredNs = 0;
+  offNs = now;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+// Amp power-on ahead of the TV.  TVs announce a power-on seconds before
+// they report on (power status "in transition standby to on", <Image View
+// On>, <Set Stream Path> while in standby) and the amp takes seconds to
+// boot, so the warm-up rule action sends the IR power-on right away.  If
+// the TV does not end up on within the warm-up window the amp is switched
+// off again.
+//
+// The amp IR power keys of turnAudioOn()/turnAudioOff() go through here
+// too, so the power-on of the TV that confirms a warm-up does not send a
+// second power key while the amp boots.
+//
+// Only to be used from the dispatch thread.
+
+// device is the amp profile index, windowMs 0 disables warm-up
+void warmupInit(int device, unsigned windowMs);
+
+// warm-up rule action, reason is kept in the flight recorder
+void warmupStart(const char *reason);
+
+// IR power-on for turnAudioOn(), skipped within the window after a warm-up
+// or an earlier power-on.  Ends a pending warm-up.
+void warmupAudioOn();
+// IR power-off for turnAudioOff(), skipped within the window after a
+// rollback or an earlier power-off.  Ends a pending warm-up.
+void warmupAudioOff();
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <atomic>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cec-lirc.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+using namespace std;
+using namespace CEC;
+
+#define WATCHDOG_SLOTS 16
+#define WATCHDOG_NESTING 4
+
+struct WatchdogSlot {
+  atomic<bool> used;
+  atomic<bool> periodic;        // worker loop using watchdogBeat()
+  atomic<uint64_t> since;       // callback start or last beat, 0 when idle
+  atomic<const char *> what;
+  atomic<const char *> step;
+  atomic<const char *> detail;
+  atomic<bool> reported;        // overrun already logged
+};
+
+// What the thread was doing when a watchdogBegin() started: the worker
+// loop's last beat (0 for callback threads) or an outer callback
+struct WatchdogOuter {
+  const char *what;
+  const char *step;
+  const char *detail;
+  uint64_t since;
+};
+
+static WatchdogSlot slots[WATCHDOG_SLOTS];
+static thread_local int mySlot = -1;
+static thread_local WatchdogOuter outer[WATCHDOG_NESTING];
+static thread_local unsigned depth = 0;
+static uint64_t budgetNs = 0;
+static uint64_t watchdogNs = 0;   // 0 when the watchdog is disabled
+static uint64_t lastPing = 0;
+static bool stalled = false;
+
+static WatchdogSlot *slot() {
+  if (mySlot < 0) {
+    for (int i = 0; i < WATCHDOG_SLOTS; i++) {
+      bool expected = false;
+      if (slots[i].used.compare_exchange_strong(expected, true)) {
+        mySlot = i;
+        break;
+      }
+    }
+    if (mySlot < 0) {
+      return nullptr;
+    }
+  }
+  return &slots[mySlot];
+}
+
+bool watchdogNotify(const char *state) {
+  const char *path = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+
+  if (!path || !path[0] || strlen(path) >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  socklen_t len = sizeof(addr);
+  if (path[0] == '@') {
+    // abstract namespace
+    addr.sun_path[0] = 0;
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+      (struct sockaddr *) &addr, len) >= 0;
+  close(fd);
+  return ok;
+}
+
+void watchdogInit(unsigned budgetMs) {
+  const char *usec = getenv("WATCHDOG_USEC");
+  const char *pid = getenv("WATCHDOG_PID");
+
+  budgetNs = uint64_t(budgetMs) * 1000000;
+  if (usec && (!pid || atoi(pid) == getpid())) {
+    watchdogNs = strtoull(usec, nullptr, 10) * 1000;
+  }
+
+  (logMask & CEC_LOG_DEBUG)
+      && cout << "watchdogInit: interval " << watchdogNs / 1000000
+          << " ms budget " << budgetMs << " ms" << endl;
+}
+
+void watchdogBegin(const char *what) {
+  WatchdogSlot *s = slot();
+  if (!s) {
+    return;
+  }
+  // Whatever ran before goes on afterwards
+  if (depth < WATCHDOG_NESTING) {
+    outer[depth] = { s->what.load(memory_order_relaxed),
+        s->step.load(memory_order_relaxed),
+        s->detail.load(memory_order_relaxed),
+        s->since.load(memory_order_relaxed) };
+  }
+  if (++depth > WATCHDOG_NESTING) {
+    // Too deep to restore, the innermost scope tracked counts as busy
+    return;
+  }
+  s->what.store(what, memory_order_relaxed);
+  s->step.store(nullptr, memory_order_relaxed);
+  s->detail.store(nullptr, memory_order_relaxed);
+  s->reported.store(false, memory_order_relaxed);
+  s->since.store(metricsNow(), memory_order_release);
+}
+
+void watchdogStep(const char *what, const char *detail) {
+  if (mySlot < 0) {
+    return;
+  }
+  slots[mySlot].detail.store(detail, memory_order_relaxed);
+  slots[mySlot].step.store(what, memory_order_release);
+}
+
+static void report(const WatchdogSlot &s, uint64_t busyNs, const char *how) {
+  const char *step = s.step.load(memory_order_acquire);
+  const char *detail = s.detail.load(memory_order_relaxed);
+
+  cerr << "watchdog: " << s.what.load(memory_order_relaxed) << " " << how
+      << " " << busyNs / 1000000 << " ms";
+  if (step) {
+    cerr << " in " << step;
+    if (detail) {
+      cerr << " " << detail;
+    }
+  }
+  cerr << endl;
+}
+
+void watchdogEnd() {
+  if (mySlot < 0 || !depth) {
+    return;
+  }
+  if (depth-- > WATCHDOG_NESTING) {
+    return;
+  }
+  WatchdogSlot &s = slots[mySlot];
+  uint64_t busy = metricsNow() - s.since.load(memory_order_relaxed);
+  if (budgetNs && busy > budgetNs) {
+    report(s, busy, "took");
+  }
+  // A worker loop stays tracked from its last beat
+  const WatchdogOuter &o = outer[depth];
+  s.what.store(o.what, memory_order_relaxed);
+  s.detail.store(o.detail, memory_order_relaxed);
+  s.step.store(o.step, memory_order_relaxed);
+  s.since.store(o.since, memory_order_release);
+}
+
+void watchdogBeat(const char *name) {
+  WatchdogSlot *s = slot();
+  if (!s) {
+    return;
+  }
+  // The loop may also run handlers under watchdogBegin() in between beats
+  s->what.store(name, memory_order_relaxed);
+  s->step.store(nullptr, memory_order_relaxed);
+  s->periodic.store(true, memory_order_relaxed);
+  s->since.store(metricsNow(), memory_order_release);
+}
+
+unsigned watchdogCheck() {
+  uint64_t now = metricsNow();
+  uint64_t stallNs = watchdogNs ? watchdogNs / 2 : 0;
+  bool healthy = true;
+
+  for (auto &s : slots) {
+    if (!s.used.load(memory_order_acquire)) {
+      continue;
+    }
+    uint64_t since = s.since.load(memory_order_acquire);
+    if (!since || now < since) {
+      continue;
+    }
+    uint64_t busy = now - since;
+
+    if (s.periodic.load(memory_order_relaxed)) {
+      if (stallNs && busy > stallNs) {
+        if (!s.reported.exchange(true)) {
+          report(s, busy, "has not run for");
+        }
+        healthy = false;
+      } else {
+        s.reported.store(false, memory_order_relaxed);
+      }
+      continue;
+    }
+
+    // Callback still running, log it once while it is stuck
+    if (budgetNs && busy > budgetNs && !s.reported.exchange(true)) {
+      report(s, busy, "busy for");
+    }
+    if (stallNs && busy > stallNs) {
+      healthy = false;
+    }
+  }
+
+  if (!watchdogNs) {
+    return 1000;
+  }
+  if (!healthy) {
+    if (!stalled) {
+      cerr << "watchdog: stall detected, stopping WATCHDOG=1 pings" << endl;
+      stalled = true;
+    }
+  } else {
+    stalled = false;
+    if (now - lastPing >= watchdogNs / 2) {
+      watchdogNotify("WATCHDOG=1");
+      lastPing = now;
+    }
+  }
+  uint64_t sleepMs = watchdogNs / 4000000;
+  return sleepMs < 1 ? 1 : (sleepMs > 1000 ? 1000 : sleepMs);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// systemd readiness and watchdog support without libsystemd.  Messages go
+// to $NOTIFY_SOCKET, WATCHDOG=1 pings are sent every half $WATCHDOG_USEC
+// from watchdogCheck() as long as every thread shows progress:
+//
+//  - callback threads bracket their work with watchdogBegin()/watchdogEnd()
+//    and name blocking steps with watchdogStep().  A callback busy for more
+//    than the latency budget is logged with the step it is in, one busy for
+//    more than half the watchdog interval stops the pings.  Brackets nest,
+//    an inner watchdogEnd() goes back to tracking the outer callback.
+//  - worker loops call watchdogBeat() every iteration and stop the pings if
+//    they do not beat for half the watchdog interval.
+//
+// All the const char * arguments must point to storage that outlives the
+// process (string literals, rule actions).
+
+// budgetMs is the callback latency budget, 0 disables overrun logging
+void watchdogInit(unsigned budgetMs);
+
+// Send a raw notify state such as "READY=1", false if not under systemd
+bool watchdogNotify(const char *state);
+
+void watchdogBegin(const char *what);
+void watchdogStep(const char *what, const char *detail = nullptr);
+void watchdogEnd();
+
+void watchdogBeat(const char *name);
+
+// Called periodically from the main loop.  Returns how long the caller may
+// sleep before the next call in milliseconds.
+unsigned watchdogCheck();
+
+struct WatchdogScope {
+  WatchdogScope(const char *what) { watchdogBegin(what); }
+  ~WatchdogScope() { watchdogEnd(); }
+};
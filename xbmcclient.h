@@ -354,6 +354,7 @@ public:
     else
     {
       m_IconType = ICON_NONE;
+      m_IconData = NULL;
       m_IconSize = 0;
     }
   }
@@ -748,76 +749,76 @@ public:
       m_UID = XBMCClientUtils::GetUniqueIdentifier();
   }
 
-  void SendNOTIFICATION(const char *Title, const char *Message, unsigned short IconType, const char *IconFile = NULL)
+  bool SendNOTIFICATION(const char *Title, const char *Message, unsigned short IconType, const char *IconFile = NULL)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketNOTIFICATION notification(Title, Message, IconType, IconFile);
-    notification.Send(m_Socket, m_Addr, m_UID);
+    return notification.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendHELO(const char *DevName, unsigned short IconType, const char *IconFile = NULL)
+  bool SendHELO(const char *DevName, unsigned short IconType, const char *IconFile = NULL)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketHELO helo(DevName, IconType, IconFile);
-    helo.Send(m_Socket, m_Addr, m_UID);
+    return helo.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendButton(const char *Button, const char *DeviceMap, unsigned short Flags, unsigned short Amount = 0)
+  bool SendButton(const char *Button, const char *DeviceMap, unsigned short Flags, unsigned short Amount = 0)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketBUTTON button(Button, DeviceMap, Flags, Amount);
-    button.Send(m_Socket, m_Addr, m_UID);
+    return button.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendButton(unsigned short ButtonCode, const char *DeviceMap, unsigned short Flags, unsigned short Amount = 0)
+  bool SendButton(unsigned short ButtonCode, const char *DeviceMap, unsigned short Flags, unsigned short Amount = 0)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketBUTTON button(ButtonCode, DeviceMap, Flags, Amount);
-    button.Send(m_Socket, m_Addr, m_UID);
+    return button.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendButton(unsigned short ButtonCode, unsigned Flags, unsigned short Amount = 0)
+  bool SendButton(unsigned short ButtonCode, unsigned Flags, unsigned short Amount = 0)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketBUTTON button(ButtonCode, Flags, Amount);
-    button.Send(m_Socket, m_Addr, m_UID);
+    return button.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendMOUSE(int X, int Y, unsigned char Flag = MS_ABSOLUTE)
+  bool SendMOUSE(int X, int Y, unsigned char Flag = MS_ABSOLUTE)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketMOUSE mouse(X, Y, Flag);
-    mouse.Send(m_Socket, m_Addr, m_UID);
+    return mouse.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendLOG(int LogLevel, const char *Message, bool AutoPrintf = true)
+  bool SendLOG(int LogLevel, const char *Message, bool AutoPrintf = true)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketLOG log(LogLevel, Message, AutoPrintf);
-    log.Send(m_Socket, m_Addr, m_UID);
+    return log.Send(m_Socket, m_Addr, m_UID);
   }
 
-  void SendACTION(const char *ActionMessage, int ActionType = ACTION_EXECBUILTIN)
+  bool SendACTION(const char *ActionMessage, int ActionType = ACTION_EXECBUILTIN)
   {
     if (m_Socket < 0)
-      return;
+      return false;
 
     CPacketACTION action(ActionMessage, ActionType);
-    action.Send(m_Socket, m_Addr, m_UID);
+    return action.Send(m_Socket, m_Addr, m_UID);
   }
 };
 
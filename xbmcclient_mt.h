@@ -0,0 +1,191 @@
+#pragma once
+
+#include <string.h>
+#include <unistd.h>
+
+#include "xbmcclient.h"
+
+// CXBMCClient variant that is safe to call from several libcec callback
+// threads at once without a global mutex.
+//
+//  - packets are encoded straight into a per-thread buffer, nothing is
+//    shared between callers except the datagram socket, and a single
+//    sendto() on a datagram socket is atomic
+//  - no call takes a lock, so a control socket thread cannot keep a
+//    SCHED_FIFO dispatch thread waiting.  Packets from one thread go out in
+//    call order, a DOWN before its UP as key presses all come from the
+//    dispatch thread.
+//
+// Only single packet messages without icons are supported, which is all the
+// bridge sends.
+
+class CXBMCClientMT
+{
+private:
+  // Gives access to the header encoder of the vendored client
+  struct HeaderEncoder : public CPacket
+  {
+    static void Construct(int PacketType, unsigned short PayloadSize,
+        unsigned int UID, char *Out)
+    {
+      ConstructHeader(PacketType, 1, 1, PayloadSize, UID, Out);
+    }
+  };
+
+  CAddress      m_Addr;
+  int           m_Socket;
+  unsigned int  m_UID;
+
+  // Append a string including its terminator, false if it does not fit
+  static bool Put(char *buf, int &len, const char *s)
+  {
+    size_t n = s ? strlen(s) : 0;
+    if (len + n + 1 > MAX_PACKET_SIZE)
+      return false;
+    memcpy(buf + len, s ? s : "", n);
+    len += n;
+    buf[len++] = '\0';
+    return true;
+  }
+
+  bool Send(char *buf, int PacketType, int len)
+  {
+    HeaderEncoder::Construct(PacketType, len - HEADER_SIZE, m_UID, buf);
+    return sendto(m_Socket, buf, len, 0, m_Addr.GetAddress(),
+        sizeof(struct sockaddr)) == len;
+  }
+
+  static char *Buffer()
+  {
+    static thread_local char buf[MAX_PACKET_SIZE];
+    return buf;
+  }
+
+  static int EncodeButton(char *buf, unsigned short ButtonCode,
+      const char *Button, const char *DeviceMap, unsigned short Flags,
+      unsigned short Amount)
+  {
+    int len = HEADER_SIZE;
+
+    // Same flag fixups as CPacketBUTTON::ConstructPayload
+    if (Button && Button[0])
+    {
+      Flags |= BTN_USE_NAME;
+      ButtonCode = 0;
+    }
+    if (Amount > 0)
+      Flags |= BTN_USE_AMOUNT;
+    if (!((Flags & BTN_DOWN) || (Flags & BTN_UP)))
+      Flags |= BTN_DOWN;
+
+    buf[len++] = (ButtonCode & 0xff00) >> 8;
+    buf[len++] =  ButtonCode & 0x00ff;
+    buf[len++] = (Flags & 0xff00) >> 8;
+    buf[len++] =  Flags & 0x00ff;
+    buf[len++] = (Amount & 0xff00) >> 8;
+    buf[len++] =  Amount & 0x00ff;
+    if (!Put(buf, len, DeviceMap) || !Put(buf, len, Button))
+      return -1;
+    return len;
+  }
+
+public:
+  CXBMCClientMT(const char *IP = "127.0.0.1", int Port = STD_PORT)
+    : m_Addr(IP, Port)
+  {
+    m_Socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    m_UID = XBMCClientUtils::GetUniqueIdentifier();
+  }
+
+  ~CXBMCClientMT()
+  {
+    if (m_Socket >= 0)
+      close(m_Socket);
+  }
+
+  CXBMCClientMT(const CXBMCClientMT &) = delete;
+  CXBMCClientMT &operator=(const CXBMCClientMT &) = delete;
+
+  bool SendHELO(const char *DevName, unsigned short IconType = ICON_NONE)
+  {
+    char *buf = Buffer();
+    int len = HEADER_SIZE;
+
+    if (m_Socket < 0 || !Put(buf, len, DevName) || len + 11 > MAX_PACKET_SIZE)
+      return false;
+    buf[len++] = ICON_NONE;
+    // port (0 => not listening) and two reserved ints
+    memset(buf + len, 0, 10);
+    len += 10;
+    return Send(buf, PT_HELO, len);
+  }
+
+  bool SendBYE()
+  {
+    if (m_Socket < 0)
+      return false;
+    return Send(Buffer(), PT_BYE, HEADER_SIZE);
+  }
+
+  bool SendNOTIFICATION(const char *Title, const char *Message,
+      unsigned short IconType = ICON_NONE)
+  {
+    char *buf = Buffer();
+    int len = HEADER_SIZE;
+
+    if (m_Socket < 0 || !Put(buf, len, Title) || !Put(buf, len, Message)
+        || len + 5 > MAX_PACKET_SIZE)
+      return false;
+    buf[len++] = ICON_NONE;
+    memset(buf + len, 0, 4);
+    len += 4;
+    return Send(buf, PT_NOTIFICATION, len);
+  }
+
+  bool SendButton(const char *Button, const char *DeviceMap,
+      unsigned short Flags, unsigned short Amount = 0)
+  {
+    char *buf = Buffer();
+    if (m_Socket < 0)
+      return false;
+    int len = EncodeButton(buf, 0, Button, DeviceMap, Flags, Amount);
+    return len > 0 && Send(buf, PT_BUTTON, len);
+  }
+
+  bool SendButton(unsigned short ButtonCode, unsigned short Flags,
+      unsigned short Amount = 0)
+  {
+    char *buf = Buffer();
+    if (m_Socket < 0)
+      return false;
+    int len = EncodeButton(buf, ButtonCode, nullptr, nullptr, Flags, Amount);
+    return len > 0 && Send(buf, PT_BUTTON, len);
+  }
+
+  bool SendACTION(const char *ActionMessage,
+      unsigned char ActionType = ACTION_EXECBUILTIN)
+  {
+    char *buf = Buffer();
+    int len = HEADER_SIZE;
+
+    if (m_Socket < 0)
+      return false;
+    buf[len++] = ActionType;
+    if (!Put(buf, len, ActionMessage))
+      return false;
+    return Send(buf, PT_ACTION, len);
+  }
+
+  bool SendLOG(int LogLevel, const char *Message)
+  {
+    char *buf = Buffer();
+    int len = HEADER_SIZE;
+
+    if (m_Socket < 0)
+      return false;
+    buf[len++] = LogLevel & 0xff;
+    if (!Put(buf, len, Message))
+      return false;
+    return Send(buf, PT_LOG, len);
+  }
+};